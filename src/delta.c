@@ -14,12 +14,16 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
 #include <unistd.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
 
 #include <expat.h>
 #include <openssl/sha.h>
@@ -34,6 +38,12 @@ enum delta_scope {
 	DELTA_SCOPE_END
 };
 
+/* a string kept allocated from one delta to the next */
+struct delta_str {
+	char	*s;
+	size_t	size;
+};
+
 struct delta_xml {
 	enum delta_scope	scope;
 	char			*xmlns;
@@ -42,11 +52,32 @@ struct delta_xml {
 	int			serial;
 	char			*publish_uri;
 	char			*publish_hash;
-	char			*publish_data;
-	unsigned int		publish_data_length;
+	FILE			*publish_file;
+	struct b64_state	publish_b64;
 	struct notification_xml	*nxml;
+	/* memory behind the strings above */
+	struct delta_str	xmlns_str;
+	struct delta_str	session_id_str;
+	struct delta_str	uri_str;
+	struct delta_str	hash_str;
 };
 
+static char *
+delta_str_set(struct delta_str *str, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *p;
+
+	if (len > str->size) {
+		if ((p = realloc(str->s, len)) == NULL)
+			fatal("%s - realloc", __func__);
+		str->s = p;
+		str->size = len;
+	}
+	memcpy(str->s, s, len);
+	return str->s;
+}
+
 static void
 log_delta_xml(struct delta_xml *delta_xml)
 {
@@ -72,30 +103,17 @@ zero_delta_publish_data(struct delta_xml *delta_xml)
 {
 	delta_xml->publish_uri = NULL;
 	delta_xml->publish_hash = NULL;
-	delta_xml->publish_data = NULL;
-	delta_xml->publish_data_length = 0;
+	delta_xml->publish_file = NULL;
 }
 
 static void
 free_delta_publish_data(struct delta_xml *delta_xml)
 {
-	free(delta_xml->publish_uri);
-	free(delta_xml->publish_hash);
-	free(delta_xml->publish_data);
+	if (delta_xml->publish_file != NULL)
+		fclose(delta_xml->publish_file);
 	zero_delta_publish_data(delta_xml);
 }
 
-static void
-free_delta_xml_data(struct xmldata *xml_data)
-{
-	struct delta_xml *delta_xml = xml_data->xml_data;
-	XML_ParserFree(xml_data->parser);
-	free(delta_xml->xmlns);
-	free(delta_xml->session_id);
-	zero_delta_global_data(delta_xml);
-	free_delta_publish_data(xml_data->xml_data);
-}
-
 enum validate_return {
 	VALIDATE_RETURN_NO_FILE,
 	VALIDATE_RETURN_FILE_DEL,
@@ -175,66 +193,66 @@ verify_publish(struct xmldata *xml_data)
 	return 0;
 }
 
+/*
+ * Open the file for a publish, its content is decoded straight into it.
+ * A withdraw leaves an empty file behind.
+ */
 static void
 write_delta(struct xmldata *xml_data, int withdraw)
 {
 	struct delta_xml *delta_xml = xml_data->xml_data;
 	FILE *f;
-	unsigned char *data_decoded;
-	int decoded_len;
 
 	if (withdraw && xml_data->opts->ignore_withdraw)
 		return;
 	f = open_working_uri_write(delta_xml->publish_uri, xml_data->opts);
 	if (f == NULL)
-		fatal("%s - file open fail", __func__);
+		PARSE_FAIL(xml_data, "failed to open %s",
+		    delta_xml->publish_uri);
 	if (withdraw) {
 		fclose(f);
 		return;
 	}
-	/* decode b64 message */
-	decoded_len = b64_decode(delta_xml->publish_data, &data_decoded);
-	if (decoded_len > 0) {
-		fwrite(data_decoded, 1, decoded_len, f);
-		free(data_decoded);
-	}
-	fclose(f);
+	delta_xml->publish_file = f;
+	b64_decode_init(&delta_xml->publish_b64);
 }
 
 static void
 start_delta_elem(struct xmldata *xml_data, const char **attr)
 {
-	XML_Parser p = xml_data->parser;
 	struct delta_xml *delta_xml = xml_data->xml_data;
 	int i;
 
 	if (delta_xml->scope != DELTA_SCOPE_NONE)
-		PARSE_FAIL(p, "parse failed - entered delta elem"
+		PARSE_FAIL(xml_data, "parse failed - entered delta elem"
 		    " unexpectedely");
 	for (i = 0; attr[i]; i += 2) {
 		if (strcmp("xmlns", attr[i]) == 0)
-			delta_xml->xmlns = xstrdup(attr[i+1]);
+			delta_xml->xmlns = delta_str_set(
+			    &delta_xml->xmlns_str, attr[i+1]);
 		else if (strcmp("version", attr[i]) == 0)
 			delta_xml->version =
 			    (int)strtol(attr[i+1], NULL, BASE10);
 		else if (strcmp("session_id", attr[i]) == 0)
-			delta_xml->session_id = xstrdup(attr[i+1]);
+			delta_xml->session_id = delta_str_set(
+			    &delta_xml->session_id_str, attr[i+1]);
 		else if (strcmp("serial", attr[i]) == 0)
 			delta_xml->serial =
 			    (int)strtol(attr[i+1], NULL, BASE10);
 		else
-			PARSE_FAIL(p, "parse failed - non conforming "
+			PARSE_FAIL(xml_data, "parse failed - non conforming "
 			    "attribute found in delta elem");
 	}
 	if (!(delta_xml->xmlns &&
 	      delta_xml->version &&
 	      delta_xml->session_id &&
 	      delta_xml->serial))
-		PARSE_FAIL(p, "parse failed - incomplete delta attributes");
+		PARSE_FAIL(xml_data,
+		    "parse failed - incomplete delta attributes");
 	if (delta_xml->version <= 0 || delta_xml->version > MAX_VERSION)
-		PARSE_FAIL(p, "parse failed - invalid version");
+		PARSE_FAIL(xml_data, "parse failed - invalid version");
 	if (strcmp(delta_xml->nxml->session_id, delta_xml->session_id) != 0)
-		PARSE_FAIL(p, "parse failed - session_id mismatch");
+		PARSE_FAIL(xml_data, "parse failed - session_id mismatch");
 
 	delta_xml->scope = DELTA_SCOPE_DELTA;
 }
@@ -242,11 +260,10 @@ start_delta_elem(struct xmldata *xml_data, const char **attr)
 static void
 end_delta_elem(struct xmldata *xml_data)
 {
-	XML_Parser p = xml_data->parser;
 	struct delta_xml *delta_xml = xml_data->xml_data;
 
 	if (delta_xml->scope != DELTA_SCOPE_DELTA) {
-		PARSE_FAIL(p, "parse failed - exited delta "
+		PARSE_FAIL(xml_data, "parse failed - exited delta "
 		    "elem unexpectedely");
 	}
 	delta_xml->scope = DELTA_SCOPE_END;
@@ -257,29 +274,39 @@ static void
 start_publish_withdraw_elem(struct xmldata *xml_data, const char **attr,
     int withdraw)
 {
-	XML_Parser p = xml_data->parser;
 	struct delta_xml *delta_xml = xml_data->xml_data;
 	int i;
 
 	if (delta_xml->scope != DELTA_SCOPE_DELTA)
-		PARSE_FAIL(p, "parse failed - entered publish/withdraw "
+		PARSE_FAIL(xml_data, "parse failed - entered publish/withdraw "
 		    "elem unexpectedely");
 	for (i = 0; attr[i]; i += 2) {
 		if (strcmp("uri", attr[i]) == 0)
-			delta_xml->publish_uri = xstrdup(attr[i+1]);
+			delta_xml->publish_uri = delta_str_set(
+			    &delta_xml->uri_str, attr[i+1]);
 		else if (strcmp("hash", attr[i]) == 0)
-			delta_xml->publish_hash = xstrdup(attr[i+1]);
+			delta_xml->publish_hash = delta_str_set(
+			    &delta_xml->hash_str, attr[i+1]);
 		else if (strcmp("xmlns", attr[i]) == 0);
 			/* XXX should we do nothing? */
 		else
-			PARSE_FAIL(p, "parse failed - non conforming "
+			PARSE_FAIL(xml_data, "parse failed - non conforming "
 			    "attribute found in publish/withdraw elem");
 	}
 	if (!delta_xml->publish_uri)
-		PARSE_FAIL(p, "parse failed - incomplete publish/withdraw attributes");
+		PARSE_FAIL(xml_data,
+		    "parse failed - incomplete publish/withdraw attributes");
 	if (withdraw && !delta_xml->publish_hash) {
-		PARSE_FAIL(p, "parse failed - incomplete withdraw attributes");
+		PARSE_FAIL(xml_data,
+		    "parse failed - incomplete withdraw attributes");
+	}
+	/* the file to replace has to be checked before it is written */
+	if (verify_publish(xml_data) == 0) {
+		PARSE_FAIL(xml_data, "failed to verify delta hash:\n%s\n%s\n%s",
+		    delta_xml->publish_hash, delta_xml->publish_uri,
+		    xml_data->opts->basedir_working);
 	}
+	write_delta(xml_data, withdraw);
 	delta_xml->scope = DELTA_SCOPE_PUBLISH;
 
 }
@@ -287,29 +314,21 @@ start_publish_withdraw_elem(struct xmldata *xml_data, const char **attr,
 static void
 end_publish_withdraw_elem(struct xmldata *xml_data, int withdraw)
 {
-	XML_Parser p = xml_data->parser;
 	struct delta_xml *delta_xml = xml_data->xml_data;
 
 	if (delta_xml->scope != DELTA_SCOPE_PUBLISH) {
-		PARSE_FAIL(p, "parse failed - exited publish/withdraw "
+		PARSE_FAIL(xml_data, "parse failed - exited publish/withdraw "
 		    "elem unexpectedely");
 	}
 	/* XXXNF this check looks dodgy */
 	if (!delta_xml->publish_uri) {
-		PARSE_FAIL(p, "parse failed - no data recovered from "
+		PARSE_FAIL(xml_data, "parse failed - no data recovered from "
 		    "publish/withdraw elem");
 	}
-	/*
-	 * TODO should we never keep this much and stream it straight to
-	 * staging file?
-	 */
-	if (verify_publish(xml_data) == 0) {
-		PARSE_FAIL(p, "failed to verify delta hash:\n%s\n%s\n%s",
-		    delta_xml->publish_hash, delta_xml->publish_uri,
-		    xml_data->opts->basedir_working);
-	}
-
-	write_delta(xml_data, withdraw);
+	if (delta_xml->publish_file != NULL &&
+	    b64_decode_final(&delta_xml->publish_b64) == -1)
+		PARSE_FAIL(xml_data, "failed to b64 decode %s",
+		    delta_xml->publish_uri);
 	free_delta_publish_data(delta_xml);
 	delta_xml->scope = DELTA_SCOPE_DELTA;
 }
@@ -318,7 +337,6 @@ static void
 delta_xml_elem_start(void *data, const char *el, const char **attr)
 {
 	struct xmldata *xml_data = data;
-	XML_Parser p = xml_data->parser;
 
 	/*
 	 * Can only enter here once as we should have no ways to get back to
@@ -328,22 +346,22 @@ delta_xml_elem_start(void *data, const char *el, const char **attr)
 		start_delta_elem(data, attr);
 	/*
 	 * Will enter here multiple times, BUT never nested. will start
-	 * collecting character data in that handler
-	 * mem is cleared in end block, (TODO or on parse failure)
+	 * decoding character data in that handler, the file is closed in
+	 * the end block or on cleanup after a parse failure
 	 */
 	else if (strcmp("publish", el) == 0)
 		start_publish_withdraw_elem(data, attr, 0);
 	else if (strcmp("withdraw", el) == 0)
 		start_publish_withdraw_elem(data, attr, 1);
 	else
-		PARSE_FAIL(p, "parse failed - unexpected elem exit found");
+		PARSE_FAIL(xml_data,
+		    "parse failed - unexpected elem exit found");
 }
 
 static void
 delta_xml_elem_end(void *data, const char *el)
 {
 	struct xmldata *xml_data = data;
-	XML_Parser p = xml_data->parser;
 
 	if (strcmp("delta", el) == 0)
 		end_delta_elem(data);
@@ -356,73 +374,259 @@ delta_xml_elem_end(void *data, const char *el)
 	else if (strcmp("withdraw", el) == 0)
 		end_publish_withdraw_elem(data, 1);
 	else
-		PARSE_FAIL(p, "parse failed - unexpected elem exit found");
+		PARSE_FAIL(xml_data,
+		    "parse failed - unexpected elem exit found");
 }
 
 static void
 delta_content_handler(void *data, const char *content, int length)
 {
-	int new_length;
 	struct xmldata *xml_data = data;
 	struct delta_xml *delta_xml = xml_data->xml_data;
 
-	if (delta_xml->scope == DELTA_SCOPE_PUBLISH) {
-		/*
-		 * optmisiation, this often gets called with '\n' as the
-		 * only data... seems wasteful
-		 */
-		if (length == 1 && content[0] == '\n')
-			return;
-
-		/* append content to publish_data */
-		new_length = delta_xml->publish_data_length + length;
-		delta_xml->publish_data = realloc(delta_xml->publish_data,
-		    sizeof(char)*(new_length + 1));
-		if (delta_xml->publish_data == NULL)
-			fatal("%s - realloc", __func__);
-
-		memcpy(delta_xml->publish_data +
-		    delta_xml->publish_data_length, content, length);
-		delta_xml->publish_data[new_length] = '\0';
-		delta_xml->publish_data_length = new_length;
-	}
+	/* withdraws have no content to decode */
+	if (delta_xml->scope == DELTA_SCOPE_PUBLISH &&
+	    delta_xml->publish_file != NULL &&
+	    b64_decode_write(&delta_xml->publish_b64, content, length,
+	    delta_xml->publish_file) == -1)
+		PARSE_FAIL(xml_data, "failed to b64 decode %s",
+		    delta_xml->publish_uri);
 }
 
+/*
+ * Get xml_data ready for the next delta of the chain. The parser and the
+ * memory of the last delta are reused.
+ */
 static void
-setup_xml_data(struct xmldata *xml_data, struct delta_xml *delta_xml,
-    char *uri, char *hash, struct opts *opts, struct notification_xml *nxml)
+setup_xml_data(struct xmldata *xml_data, char *uri, char *hash)
 {
+	struct delta_xml *delta_xml = xml_data->xml_data;
+
 	xml_data->uri = uri;
-	xml_data->opts = opts;
 	xml_data->hash = hash;
+	xml_data->stop = 0;
+	xml_data->buffer = NULL;
 	/* delta doesn't use modified since */
 	xml_data->modified_since[0] = '\0';
-
-	xml_data->parser = XML_ParserCreate(NULL);
-	if (xml_data->parser == NULL)
-		fatalx("%s - XML_ParserCreate", __func__);
+	xml_data->etag[0] = '\0';
+	xml_data->validator[0] = '\0';
+
+	/* a parser that can't be reset is replaced */
+	if (xml_data->parser != NULL &&
+	    !XML_ParserReset(xml_data->parser, NULL)) {
+		XML_ParserFree(xml_data->parser);
+		xml_data->parser = NULL;
+	}
+	if (xml_data->parser == NULL) {
+		xml_data->parser = XML_ParserCreate(NULL);
+		if (xml_data->parser == NULL)
+			fatalx("%s - XML_ParserCreate", __func__);
+	}
+	/* a reset parser has lost its handlers */
 	XML_SetElementHandler(xml_data->parser, delta_xml_elem_start,
 	    delta_xml_elem_end);
 	XML_SetCharacterDataHandler(xml_data->parser, delta_content_handler);
 	XML_SetUserData(xml_data->parser, xml_data);
+	if (xml_data->opts->tokenizer)
+		xml_tok_init(xml_data, delta_xml_elem_start,
+		    delta_xml_elem_end, delta_content_handler);
 
-	xml_data->xml_data = delta_xml;
 	zero_delta_global_data(delta_xml);
 	zero_delta_publish_data(delta_xml);
+}
+
+/*
+ * Parser and buffers for applying a chain of deltas one after the other.
+ */
+struct xmldata *
+new_delta_xml_data(struct opts *opts, struct notification_xml *nxml)
+{
+	struct xmldata *xml_data;
+	struct delta_xml *delta_xml;
+
+	if ((xml_data = calloc(1, sizeof(struct xmldata))) == NULL ||
+	    (delta_xml = calloc(1, sizeof(struct delta_xml))) == NULL)
+		fatal("%s - calloc", __func__);
+	xml_data->opts = opts;
+	xml_data->spool_fd = -1;
+	xml_data->xml_data = delta_xml;
 	delta_xml->nxml = nxml;
+	return xml_data;
+}
+
+void
+free_delta_xml_data(struct xmldata *xml_data)
+{
+	struct delta_xml *delta_xml = xml_data->xml_data;
+
+	free_delta_publish_data(delta_xml);
+	if (xml_data->parser != NULL)
+		XML_ParserFree(xml_data->parser);
+	xml_tok_free(xml_data);
+	free(delta_xml->xmlns_str.s);
+	free(delta_xml->session_id_str.s);
+	free(delta_xml->uri_str.s);
+	free(delta_xml->hash_str.s);
+	free(delta_xml);
+	free(xml_data);
 }
 
 int
-fetch_delta_xml(char *uri, char *hash, struct opts *opts,
-    struct notification_xml* nxml)
+fetch_delta_xml(struct xmldata *xml_data, char *uri, char *hash)
 {
-	struct xmldata xml_data;
-	struct delta_xml delta_xml;
 	int ret = 0;
-	setup_xml_data(&xml_data, &delta_xml, uri, hash, opts, nxml);
-	if (fetch_xml_uri(&xml_data) != 200)
+
+	setup_xml_data(xml_data, uri, hash);
+	if (fetch_xml_uri(xml_data) != 200)
 		ret = 1;
-	free_delta_xml_data(&xml_data);
+	free_delta_publish_data(xml_data->xml_data);
 	return ret;
 }
 
+
+/*
+ * Apply a delta that has already been downloaded (and hash checked) into fd.
+ */
+static int
+apply_delta_xml(struct xmldata *xml_data, char *uri, int fd)
+{
+	int ret = 0;
+
+	setup_xml_data(xml_data, uri, NULL);
+	if (parse_xml_file(xml_data, fd) != 0)
+		ret = 1;
+	free_delta_publish_data(xml_data->xml_data);
+	return ret;
+}
+
+/*
+ * Deltas downloaded in parallel are spooled next to the state file until
+ * it is their turn to be applied.
+ */
+#define DELTA_SPOOL "%s.%d"
+
+static int
+open_delta_spool(struct opts *opts, int serial, int flags)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), DELTA_SPOOL, DELTA_SPOOL_FILENAME, serial);
+	return openat(opts->primary_dir, name, flags, S_IRUSR|S_IWUSR);
+}
+
+static void
+unlink_delta_spool(struct opts *opts, int serial)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), DELTA_SPOOL, DELTA_SPOOL_FILENAME, serial);
+	if (unlinkat(opts->primary_dir, name, 0) == -1 && errno != ENOENT)
+		log_warn("%s - unlink %s", __func__, name);
+}
+
+/*
+ * Start downloading delta d into its spool file.
+ */
+static int
+start_delta_spool(struct xmldata *data, struct delta_item *d,
+    struct opts *opts)
+{
+	data->uri = d->uri;
+	data->hash = d->hash;
+	data->opts = opts;
+	data->parser = NULL;
+	data->spool_fd = open_delta_spool(opts, d->serial,
+	    O_RDWR|O_CREAT|O_TRUNC);
+	if (data->spool_fd == -1) {
+		log_warn("%s - open delta %d", __func__, d->serial);
+		return -1;
+	}
+	fetch_xml_start(data);
+	return 0;
+}
+
+/*
+ * Download the first count deltas with up to opts->delta_jobs concurrent
+ * transfers while applying them strictly in serial order. Downloads run at
+ * most twice that many deltas ahead of the one applied, a slow delta must
+ * not leave the rest of the chain spooled and open. Any failed download
+ * stops the whole run. Returns the number of deltas applied.
+ */
+int
+fetch_deltas_parallel(int count, struct opts *opts,
+    struct notification_xml *nxml)
+{
+	struct delta_item **items, *d;
+	struct xmldata *spool, **set, *xml_data;
+	int i, j, n, jobs, started = 0, applied = 0;
+
+	if ((items = calloc(count, sizeof(*items))) == NULL)
+		fatal("%s - calloc", __func__);
+	i = 0;
+	TAILQ_FOREACH(d, &nxml->delta_q, q) {
+		if (i == count)
+			break;
+		items[i++] = d;
+	}
+	count = i;
+	jobs = opts->delta_jobs < count ? opts->delta_jobs : count;
+	if ((spool = calloc(count, sizeof(*spool))) == NULL ||
+	    (set = calloc(jobs, sizeof(*set))) == NULL)
+		fatal("%s - calloc", __func__);
+	for (i = 0; i < count; i++)
+		spool[i].spool_fd = -1;
+	xml_data = new_delta_xml_data(opts, nxml);
+
+	for (i = 0; i < count; i++) {
+		/* keep jobs transfers going until delta i is in */
+		for (;;) {
+			n = 0;
+			for (j = i; j < started; j++)
+				if (spool[j].req != NULL)
+					set[n++] = &spool[j];
+			while (n < jobs && started < count &&
+			    started - i < 2 * jobs) {
+				if (start_delta_spool(&spool[started],
+				    items[started], opts) == -1)
+					goto out;
+				set[n++] = &spool[started++];
+			}
+			if (spool[i].req == NULL)
+				break;
+			j = fetch_xml_wait_any(set, n);
+			if (fetch_xml_wait(set[j]) != 200) {
+				log_warnx("failed to fetch delta %s",
+				    set[j]->uri);
+				goto out;
+			}
+		}
+		if (lseek(spool[i].spool_fd, 0, SEEK_SET) == -1) {
+			log_warn("%s - lseek delta %d", __func__,
+			    items[i]->serial);
+			goto out;
+		}
+		if (apply_delta_xml(xml_data, items[i]->uri,
+		    spool[i].spool_fd) != 0) {
+			log_warnx("failed to apply delta %s", items[i]->uri);
+			goto out;
+		}
+		close(spool[i].spool_fd);
+		spool[i].spool_fd = -1;
+		unlink_delta_spool(opts, items[i]->serial);
+		applied++;
+	}
+
+out:
+	for (i = applied; i < started; i++) {
+		if (spool[i].req != NULL)
+			fetch_xml_cancel(&spool[i]);
+		if (spool[i].spool_fd != -1)
+			close(spool[i].spool_fd);
+		unlink_delta_spool(opts, items[i]->serial);
+	}
+	free_delta_xml_data(xml_data);
+	free(set);
+	free(spool);
+	free(items);
+	return applied;
+}
@@ -46,54 +46,76 @@
  */
 
 
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/queue.h>
+
+#include <asr.h>
 #include <stdio.h>
 #include <err.h>
 #include <string.h>
 #include <ctype.h>
 #include <time.h>
 #include <unistd.h>
-#include <sys/wait.h>
 #include <stdlib.h>
 #include <tls.h>
 #include <limits.h>
 #include <fcntl.h>
 #include <netdb.h>
-#include <signal.h>
-#include <libgen.h>
-#include <unistd.h>
 #include <resolv.h>
 #include <errno.h>
 #include <poll.h>
-#include <util.h>
+#include <pthread.h>
 #include <vis.h>
-#include <setjmp.h>
+#include <zlib.h>
 
 #include "rrdp.h"
 #include "log.h"
 
 #define USER_AGENT "rrdp-client v0.1"
-#define HTTP_USER_AGENT "rrdp-client v0.1"
 #define IF_MODIFIED_SINCE "If-Modified-Since"
+#define IF_NONE_MATCH "If-None-Match"
 #define DATE "Date:"
 #define DATE_LEN 5
 #define LAST_MODIFIED "Last-Modified:"
 #define LAST_MODIFIED_LEN 14
+#define ETAG "ETag:"
+#define ETAG_LEN 5
 
 #define	HTTP_URL	"http://"	/* http URL prefix */
 #define	HTTPS_URL	"https://"	/* https URL prefix */
-#define HTTPS_PORT	443
-#define HTTP_PORT	80
+#define HTTPS_PORT	"443"
+#define HTTP_PORT	"80"
+
+#define HTTP_BUF_SIZE	(128 * 1024)
+#define HTTP_ZBUF_SIZE	(128 * 1024)
+#define CHUNK_MOVE_MAX	(4 * 1024)	/* larger chunks are not moved */
+#define MAX_REDIRECTS	10
+#define MAX_ATTEMPTS	4	/* concurrent connects per connection */
+#define ATTEMPT_DELAY	250	/* ms until the next address is tried */
+#define DNS_CACHE_TTL	300	/* s a resolver result is used in a run */
+#define ENDPOINT_TTL	(7 * 24 * 60 * 60)	/* s after it last worked */
+#define ENDPOINT_MAX_FAILURES	3
+#define ENDPOINT_TIMEOUT	2000	/* ms before resolving after all */
+
+#define HANDSHAKE_TIMEOUT	20	/* s for the proxy and TLS handshakes */
+#define RESPONSE_TIMEOUT	30	/* s from a request to its first byte */
+#define IDLE_TIMEOUT		30	/* s without data in a response */
+#define TRANSFER_WINDOW		60	/* s a body's rate is measured over */
+#define TRANSFER_MIN_RATE	1024	/* bytes/s a body has to come in at */
+
+#define PIPELINE_MAX		16	/* requests queued on one connection */
 
-#define EMPTYSTRING(x)	((x) == NULL || (*(x) == '\0'))
-
-static jmp_buf  httpabort;
 int connect_timeout = 10;
-int redirect_loop;
-static int retried;
+
+static const char *httpuseragent = "User-Agent: " USER_AGENT;
+static const char *httpacceptenc = "Accept-Encoding: gzip, deflate\r\n";
 
 struct header_data {
 	char date[TIME_LEN];
 	char last_modified[TIME_LEN];
+	char etag[VALIDATOR_LEN];
 };
 
 static void
@@ -108,9 +130,11 @@ get_value_from_header(char *buff, size_t buff_len, char *value, size_t val_len)
 			break;
 		}
 	}
+	if (val == NULL)
+		return;
 	to_copy = buff_len - i;
-	if (to_copy > val_len) {
-		to_copy = val_len;
+	if (to_copy > val_len - 1) {
+		to_copy = val_len - 1;
 	}
 	if (val[to_copy - 1] == '\r' || val[to_copy - 1] == '\n')
 		to_copy--;
@@ -130,6 +154,10 @@ header_callback(char *buffer, size_t size, size_t nitems, void *userdata)
 		get_value_from_header(buffer + LAST_MODIFIED_LEN,
 		    nitems - LAST_MODIFIED_LEN,
 		    header_data->last_modified, TIME_LEN);
+	} else if (nitems >= ETAG_LEN &&
+	    strncasecmp(ETAG, buffer, ETAG_LEN) == 0) {
+		get_value_from_header(buffer + ETAG_LEN, nitems - ETAG_LEN,
+		    header_data->etag, VALIDATOR_LEN);
 	}
 	return nitems;
 }
@@ -138,17 +166,18 @@ static size_t
 write_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
 {
 	struct xmldata *xml_data = userdata;
-	XML_Parser p = xml_data->parser;
 	if (xml_data->hash)
 		SHA256_Update(&xml_data->ctx, (const u_int8_t *)ptr, nmemb);
-	if (!p)
-		return 0;
-	if (!XML_Parse(p, ptr, nmemb, 0)) {
-		fprintf(stderr, "Parse error at line %lu:\n%s\n",
-			XML_GetCurrentLineNumber(p),
-			XML_ErrorString(XML_GetErrorCode(p)));
-		return 0;
+	/* no parser means the document is only spooled to a file */
+	if (!xml_data->parser) {
+		if (write(xml_data->spool_fd, ptr, nmemb) != (ssize_t)nmemb) {
+			log_warn("%s - write", __func__);
+			return 0;
+		}
+		return nmemb;
 	}
+	if (xml_parse(xml_data, ptr, nmemb, 0) == -1 && !xml_data->stop)
+		return 0;
 	return nmemb;
 }
 
@@ -171,106 +200,6 @@ hash_check(unsigned char *obuff, const char *hash) {
 	return 0;
 }
 
-/*
- * Set the SIGALRM interval timer for wait seconds, 0 to disable.
- */
-static void
-alarmtimer(int wait)
-{
-	int save_errno = errno;
-	struct itimerval itv;
-
-	itv.it_value.tv_sec = wait;
-	itv.it_value.tv_usec = 0;
-	itv.it_interval = itv.it_value;
-	setitimer(ITIMER_REAL, &itv, NULL);
-	errno = save_errno;
-}
-
-/*
- * Abort a http retrieval
- */
-/* ARGSUSED */
-static void
-aborthttp(int signo)
-{
-	alarmtimer(0);
-	log_warnx("\nfetch aborted.\n");
-	longjmp(httpabort, 1);
-}
-
-static char *
-ftp_readline(FILE *fp, size_t *lenp)
-{
-	return fparseln(fp, lenp, NULL, "\0\0\0", 0);
-}
-
-static void
-ftp_close(FILE **fin, struct tls **tls, int *fd)
-{
-	int	ret;
-
-	if (*tls != NULL) {
-		do {
-			ret = tls_close(*tls);
-		} while (ret == TLS_WANT_POLLIN || ret == TLS_WANT_POLLOUT);
-		tls_free(*tls);
-		*tls = NULL;
-	}
-	if (*fd != -1) {
-		close(*fd);
-		*fd = -1;
-	}
-	if (*fin != NULL) {
-		fclose(*fin);
-		*fin = NULL;
-	}
-}
-
-static const char *
-sockerror(struct tls *tls)
-{
-	int	save_errno = errno;
-	if (tls != NULL) {
-		const char *tlserr = tls_error(tls);
-		if (tlserr != NULL)
-			return tlserr;
-	}
-	return strerror(save_errno);
-}
-
-/* ARGSUSED */
-static void
-tooslow(int signo)
-{
-	dprintf(STDERR_FILENO, "%s: connect taking too long\n", "rrdp");
-	_exit(2);
-}
-
-/*
- * Wait for an asynchronous connect(2) attempt to finish.
- */
-static int
-connect_wait(int s)
-{
-	struct pollfd pfd[1];
-	int error = 0;
-	socklen_t len = sizeof(error);
-
-	pfd[0].fd = s;
-	pfd[0].events = POLLOUT;
-
-	if (poll(pfd, 1, -1) == -1)
-		return -1;
-	if (getsockopt(s, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
-		return -1;
-	if (error != 0) {
-		errno = error;
-		return -1;
-	}
-	return 0;
-}
-
 static char
 hextochar(const char *str)
 {
@@ -413,458 +342,1376 @@ recode_credentials(const char *userinfo)
 	return (creds);
 }
 
-static int
-stdio_tls_write_wrapper(void *arg, const char *buf, int len)
-{
-	struct tls *tls = arg;
-	ssize_t ret;
+/*
+ * The HTTP client below is event driven: every transfer is a connection
+ * state machine and a single poll(2) loop advances all of them, so one
+ * process can drive many transfers at the same time. Name resolution is
+ * done with the asynchronous resolver, sockets and TLS are non-blocking.
+ */
+enum http_state {
+	STATE_RESOLVE,
+	STATE_CONNECT,
+	STATE_PROXY_REQUEST,
+	STATE_PROXY_STATUS,
+	STATE_PROXY_RESPONSE,
+	STATE_TLSCONNECT,
+	STATE_REQUEST,
+	STATE_RESPONSE_STATUS,
+	STATE_RESPONSE_HEADER,
+	STATE_RESPONSE_DATA,
+	STATE_RESPONSE_CHUNKED_HEADER,
+	STATE_RESPONSE_CHUNKED_CRLF,
+	STATE_RESPONSE_CHUNKED_TRAILER,
+	STATE_IDLE,
+	STATE_CLOSE
+};
 
-	do {
-		ret = tls_write(tls, buf, len);
-	} while (ret == TLS_WANT_POLLIN || ret == TLS_WANT_POLLOUT);
+enum res {
+	DONE,		/* progress was made, step again */
+	WANT_POLLIN,
+	WANT_POLLOUT,
+	FAILED
+};
 
-	return ret;
+struct http_connection;
+
+/*
+ * One address of a host, the port included.
+ */
+struct http_addr {
+	struct sockaddr_storage	 ss;
+	socklen_t		 len;
+};
+
+/*
+ * A pending non-blocking connect(2) to one address of the host.
+ */
+struct http_attempt {
+	struct http_addr	*addr;
+	long long		 deadline;
+	int			 fd;
+	short			 revents;
+};
+
+struct http_request {
+	TAILQ_ENTRY(http_request)	 entry;
+	struct xmldata		*data;
+	struct http_connection	*conn;
+	char			*uri;
+	char			*host;
+	char			*port;
+	char			*path;
+	char			*key;
+	char			*conditional;
+	char			*range;
+	struct header_data	 header_data;
+	char			 date[TIME_LEN];	/* of the request */
+	long			 status;
+	long long		 deadline;	/* end of the rate window */
+	off_t			 window;	/* bytes read in the window */
+	int			 redirects;
+	int			 retried;
+	int			 compressed;
+	int			 whole;		/* a 206 of the whole document */
+	int			 sent;
+	int			 done;
+};
+
+TAILQ_HEAD(http_req_q, http_request);
+
+/*
+ * Connections are keyed by the origin host:port and the proxy in use.
+ * Once a response body has been read completely and the server did not
+ * ask us to close, the connection is parked on the idle list for reuse.
+ * With pipelining (-m) further requests to the same origin queue up
+ * behind req and are sent before their turn; the responses come back
+ * in order.
+ */
+struct http_connection {
+	TAILQ_ENTRY(http_connection)	 entry;
+	char			*key;
+	char			*host;
+	char			*port;
+	char			*proxyhost;
+	char			*proxyport;
+	char			*proxyauth;
+	char			*redirect;
+	struct http_request	*req;
+	struct http_req_q	 queue;
+	int			 nqueue;
+	char			*target;
+	struct asr_query	*asq;
+	struct http_addr	*addrs;
+	size_t			 naddrs;
+	size_t			 nextaddr;
+	struct http_attempt	 attempts[MAX_ATTEMPTS];
+	int			 nattempts;
+	long long		 nextattempt;
+	struct tls		*tls;
+	char			*buf;
+	size_t			 bufoff;	/* start of unconsumed data */
+	size_t			 bufpos;	/* end of received data */
+	char			*wbuf;
+	size_t			 wbuflen;
+	size_t			 wbufpos;
+	z_stream		*zs;
+	char			*zbuf;
+	off_t			 iosz;
+	long long		 deadline;	/* resolver and connect */
+	long long		 timeout;	/* current phase stalled */
+	enum http_state		 state;
+	int			 fd;
+	int			 pfd;
+	short			 events;
+	short			 revents;
+	int			 status;
+	int			 retryafter;
+	int			 chunked;
+	int			 keepalive;
+	int			 reused;
+	int			 closing;	/* no requests after req */
+	int			 eof;
+	int			 zdone;
+	int			 discard;
+	int			 fromendpoint;
+	int			 triedendpoint;
+};
+
+TAILQ_HEAD(http_conn_q, http_connection);
+static struct http_conn_q active = TAILQ_HEAD_INITIALIZER(active);
+static struct http_conn_q idle = TAILQ_HEAD_INITIALIZER(idle);
+/* bumped whenever active changes, see http_run() */
+static unsigned int active_gen;
+
+/*
+ * Every host gets its own TLS configuration and with it a session file
+ * in the cachedir, so later connections can resume the TLS session with
+ * an abbreviated handshake. The file is unlinked right away unless the
+ * sessions are to be kept for later runs (-s).
+ *
+ * A single configuration for all hosts is not possible with libtls: the
+ * session file belongs to the configuration, it is read when connecting
+ * and written when the handshake is done, and handshakes to different
+ * hosts overlap.
+ */
+struct tls_host {
+	TAILQ_ENTRY(tls_host)	 entry;
+	char			*key;
+	struct tls_config	*config;
+	int			 fd;
+};
+
+static TAILQ_HEAD(, tls_host) tls_hosts = TAILQ_HEAD_INITIALIZER(tls_hosts);
+
+/*
+ * Resolver results are kept for the rest of the run, keyed by the
+ * host:port connected to (the proxy, if one is used).
+ */
+struct http_dns {
+	TAILQ_ENTRY(http_dns)	 entry;
+	char			*target;
+	struct http_addr	*addrs;
+	size_t			 naddrs;
+	long long		 expires;
+};
+
+static TAILQ_HEAD(, http_dns) dns_cache = TAILQ_HEAD_INITIALIZER(dns_cache);
+
+/*
+ * The address that last connected to each host is remembered in the
+ * cachedir. The next run connects to it without asking the resolver and
+ * it is tried first among the resolved addresses. An endpoint expires
+ * ENDPOINT_TTL after it last worked or once it failed
+ * ENDPOINT_MAX_FAILURES times in a row.
+ */
+struct http_endpoint {
+	TAILQ_ENTRY(http_endpoint) entry;
+	char			*target;
+	struct http_addr	 addr;
+	time_t			 expires;
+	int			 failures;
+};
+
+static TAILQ_HEAD(, http_endpoint) endpoints =
+    TAILQ_HEAD_INITIALIZER(endpoints);
+
+/* the CA bundle file, read from disk once by http_init() */
+static uint8_t *tls_ca_mem;
+static size_t tls_ca_size;
+
+/*
+ * Batch mode runs every repository in a thread of its own so they can
+ * keep the synchronous code, but only the thread holding job_lock runs.
+ * While it waits in http_run() it drives the connections of all of them
+ * and hands job_lock to a job whose transfer finished. The caches and
+ * the connections are shared without further locking.
+ */
+struct http_job {
+	TAILQ_ENTRY(http_job)	 entry;
+	pthread_t		 thread;
+	pthread_cond_t		 cond;
+	void			(*fn)(void *);
+	void			*arg;
+	/* what the job waits for, NULL if it did not start yet */
+	struct xmldata		**set;
+	int			 n;
+	int			 wake;
+};
+
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static TAILQ_HEAD(, http_job) job_waiting =
+    TAILQ_HEAD_INITIALIZER(job_waiting);
+static struct http_job *job_current;
+
+static void	http_req_start(struct http_request *);
+static void	http_process(struct http_connection *);
+static enum res	http_connect(struct http_connection *);
+static void	http_attempts_close(struct http_connection *);
+
+/*
+ * Monotonic time in milliseconds.
+ */
+long long
+getmonotime(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+		fatal("%s - clock_gettime", __func__);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
+/*
+ * Split host[:port] into its parts, an IPv6 address must be in brackets.
+ */
 static int
-stdio_tls_read_wrapper(void *arg, char *buf, int len)
+http_split_host(char *hostport, char **host, char **port, const char *defport)
 {
-	struct tls *tls = arg;
-	ssize_t ret;
+	char *h, *tail, *p;
 
-	do {
-		ret = tls_read(tls, buf, len);
-	} while (ret == TLS_WANT_POLLIN || ret == TLS_WANT_POLLOUT);
+	h = hostport;
+	if (*h == '[' && (tail = strrchr(h, ']')) != NULL &&
+	    (tail[1] == '\0' || tail[1] == ':')) {
+		h++;
+		*tail++ = '\0';
+	} else
+		tail = h;
 
+	if ((p = strrchr(tail, ':')) != NULL)
+		*p++ = '\0';
+	if (*h == '\0' || (p != NULL && *p == '\0'))
+		return -1;
+	*host = xstrdup(h);
+	*port = xstrdup(p != NULL ? p : defport);
+	return 0;
+}
+
+/*
+ * Format host and port for the Host header or a CONNECT request. The
+ * port is left out if it equals defport.
+ */
+static char *
+http_authority(const char *host, const char *port, const char *defport)
+{
+	char *h, *p, *ret;
+	int v6, showport;
+
+	/* strip off scoped address portion, since it's local to node */
+	h = xstrdup(host);
+	if ((p = strchr(h, '%')) != NULL)
+		*p = '\0';
+	v6 = strchr(h, ':') != NULL;
+	showport = defport == NULL || strcmp(port, defport) != 0;
+	if (asprintf(&ret, "%s%s%s%s%s", v6 ? "[" : "", h, v6 ? "]" : "",
+	    showport ? ":" : "", showport ? port : "") == -1)
+		fatal("%s - asprintf", __func__);
+	free(h);
 	return ret;
 }
 
 static int
-proxy_connect(int socket, char *host, char *cookie)
+http_parse_uri(const char *uri, char **host, char **port, char **path)
 {
-	int l;
-	char buf[1024];
-	char *connstr, *hosttail, *port;
+	const char *h, *p;
+	char *hostport;
 
-	if (*host == '[' && (hosttail = strrchr(host, ']')) != NULL &&
-		(hosttail[1] == '\0' || hosttail[1] == ':')) {
-		host++;
-		*hosttail++ = '\0';
-	} else
-		hosttail = host;
-
-	port = strrchr(hosttail, ':');		/* find portnum */
-	if (port != NULL)
-		*port++ = '\0';
-	if (!port)
-		port = "443";
-
-	if (cookie) {
-		l = asprintf(&connstr, "CONNECT %s:%s HTTP/1.1\r\n"
-			"Proxy-Authorization: Basic %s\r\n%s\r\n\r\n",
-			host, port, cookie, HTTP_USER_AGENT);
-	} else {
-		l = asprintf(&connstr, "CONNECT %s:%s HTTP/1.1\r\n%s\r\n\r\n",
-			host, port, HTTP_USER_AGENT);
+	if (strncasecmp(uri, HTTPS_URL, sizeof(HTTPS_URL) - 1) != 0) {
+		warnx("%s: URL not permitted", uri);
+		return -1;
 	}
-
-	if (l == -1)
-		fatal("Could not allocate memory to assemble connect string!");
-	log_debug("%s", connstr);
-	if (write(socket, connstr, l) != l)
-		fatal("Could not send connect string");
-	read(socket, &buf, sizeof(buf)); /* only proxy header XXX: error
-	    handling? */
-	free(connstr);
-	return(200);
+	h = uri + sizeof(HTTPS_URL) - 1;
+	p = h + strcspn(h, "/");
+	if ((hostport = strndup(h, p - h)) == NULL)
+		fatal("%s - strndup", __func__);
+	if (http_split_host(hostport, host, port, HTTPS_PORT) == -1) {
+		warnx("%s: bad host", uri);
+		free(hostport);
+		return -1;
+	}
+	free(hostport);
+	if (*p == '/')
+		p++;
+	*path = url_encode(p);
+	return 0;
 }
 
 static int
-save_chunked(FILE *fin, struct tls *tls, int out, char *buf, size_t buflen,
-    off_t *bytes, struct xmldata *data)
+http_parse_proxy(const char *proxy, char **host, char **port, char **auth)
 {
-	char			*header, *end, *cp;
-	unsigned long		chunksize;
-	size_t			hlen, rlen, wlen;
-	ssize_t			written;
-	char			cr, lf;
-
-	for (;;) {
-		header = ftp_readline(fin, &hlen);
-		if (header == NULL)
-			break;
-		/* strip CRLF and any optional chunk extension */
-		header[strcspn(header, ";\r\n")] = '\0';
-		errno = 0;
-		chunksize = strtoul(header, &end, 16);
-		if (errno || header[0] == '\0' || *end != '\0' ||
-		    chunksize > INT_MAX) {
-			warnx("Invalid chunk size '%s'", header);
-			free(header);
-			return -1;
+	char *p, *hostport, *at;
+
+	*auth = NULL;
+	if (strncasecmp(proxy, HTTP_URL, sizeof(HTTP_URL) - 1) != 0)
+		goto bad;
+	p = xstrdup(proxy + sizeof(HTTP_URL) - 1);
+	p[strcspn(p, "/")] = '\0';
+	hostport = p;
+	/* look for proxy credentials */
+	if ((at = strrchr(p, '@')) != NULL) {
+		*at = '\0';
+		if (strchr(p, ':') == NULL) {
+			free(p);
+			goto bad;
 		}
-		free(header);
+		*auth = recode_credentials(p);
+		hostport = at + 1;
+	}
+	if (http_split_host(hostport, host, port, HTTP_PORT) == -1) {
+		free(*auth);
+		*auth = NULL;
+		free(p);
+		goto bad;
+	}
+	free(p);
+	return 0;
+bad:
+	warnx("Malformed proxy URL: %s", proxy);
+	return -1;
+}
 
-		if (chunksize == 0) {
-			/* We're done.  Ignore optional trailer. */
-			return 0;
-		}
+/*
+ * Point req at the (possibly redirected) req->uri.
+ */
+static int
+http_req_target(struct http_request *req)
+{
+	const char *proxy = req->data->opts->httpproxy;
+
+	free(req->host);
+	free(req->port);
+	free(req->path);
+	free(req->key);
+	req->host = req->port = req->path = req->key = NULL;
+	if (http_parse_uri(req->uri, &req->host, &req->port, &req->path) == -1)
+		return -1;
+	if (asprintf(&req->key, "%s:%s %s", req->host, req->port,
+	    proxy != NULL ? proxy : "") == -1)
+		fatal("%s - asprintf", __func__);
+	return 0;
+}
 
-		for (written = 0; chunksize != 0; chunksize -= rlen) {
-			rlen = (chunksize < buflen) ? chunksize : buflen;
-			rlen = fread(buf, 1, rlen, fin);
-			if (rlen == 0)
-				break;
-			*bytes += rlen;
-			for (cp = buf, wlen = rlen; wlen > 0;
-			    wlen -= written, cp += written) {
-				if ((written = write_callback(cp, 1, wlen,
-				    data)) == 0) {
-					warnx("parse error");
-					return -1;
-				}
-			}
-		}
+static void
+http_req_done(struct http_request *req, long status)
+{
+	req->status = status;
+	req->done = 1;
+	req->conn = NULL;
+}
 
-		if (rlen == 0 ||
-		    fread(&cr, 1, 1, fin) != 1 ||
-		    fread(&lf, 1, 1, fin) != 1)
-			break;
+static void
+http_req_free(struct http_request *req)
+{
+	free(req->uri);
+	free(req->host);
+	free(req->port);
+	free(req->path);
+	free(req->key);
+	free(req->conditional);
+	free(req->range);
+	free(req);
+}
 
-		if (cr != '\r' || lf != '\n') {
-			warnx("Invalid chunked encoding");
-			return -1;
-		}
-	}
+static struct http_connection *
+http_new(struct http_request *req)
+{
+	struct http_connection *conn;
+	const char *proxy = req->data->opts->httpproxy;
+
+	if ((conn = calloc(1, sizeof(*conn))) == NULL)
+		fatal("%s - calloc", __func__);
+	conn->fd = -1;
+	conn->pfd = -1;
+	TAILQ_INIT(&conn->queue);
+	conn->key = xstrdup(req->key);
+	conn->host = xstrdup(req->host);
+	conn->port = xstrdup(req->port);
+	if ((conn->buf = malloc(HTTP_BUF_SIZE)) == NULL)
+		fatal("%s - malloc", __func__);
+	if (proxy != NULL && http_parse_proxy(proxy, &conn->proxyhost,
+	    &conn->proxyport, &conn->proxyauth) == -1)
+		goto fail;
+
+	if (asprintf(&conn->target, "%s:%s", conn->proxyhost != NULL ?
+	    conn->proxyhost : conn->host, conn->proxyhost != NULL ?
+	    conn->proxyport : conn->port) == -1)
+		fatal("%s - asprintf", __func__);
+	conn->state = STATE_RESOLVE;
+	return conn;
+fail:
+	free(conn->buf);
+	free(conn->key);
+	free(conn->host);
+	free(conn->port);
+	free(conn->proxyhost);
+	free(conn->proxyport);
+	free(conn->proxyauth);
+	free(conn);
+	return NULL;
+}
 
-	if (ferror(fin))
-		warnx("Error while reading from socket: %s", sockerror(tls));
-	else
-		warnx("Invalid chunked encoding: short read");
+static void
+http_zfree(struct http_connection *conn)
+{
+	if (conn->zs == NULL)
+		return;
+	inflateEnd(conn->zs);
+	free(conn->zs);
+	conn->zs = NULL;
+	conn->zdone = 0;
+}
 
-	return -1;
+static void
+http_free(struct http_connection *conn)
+{
+	if (conn->asq != NULL)
+		asr_abort(conn->asq);
+	http_attempts_close(conn);
+	free(conn->addrs);
+	free(conn->target);
+	if (conn->tls != NULL) {
+		/* best effort, the socket is non-blocking */
+		tls_close(conn->tls);
+		tls_free(conn->tls);
+	}
+	if (conn->fd != -1)
+		close(conn->fd);
+	http_zfree(conn);
+	free(conn->zbuf);
+	free(conn->buf);
+	free(conn->wbuf);
+	free(conn->key);
+	free(conn->host);
+	free(conn->port);
+	free(conn->proxyhost);
+	free(conn->proxyport);
+	free(conn->proxyauth);
+	free(conn->redirect);
+	free(conn);
 }
 
+/*
+ * A reused connection that fails before any part of the response arrived
+ * was most likely closed by the server while it was idle.
+ */
 static int
-url_get(const char *origline, const char *proxyenv, struct xmldata *data,
-    struct header_data *header_data, char *modified_since)
-{
-	char pbuf[NI_MAXSERV], hbuf[NI_MAXHOST], *cp, *portnum, *path, ststr[4];
-	char *hosttail, *cause = "unknown", *newline, *host, *port, *buf = NULL;
-	char *epath, *redirurl, *loctail, *h, *p, gerror[200];
-	int error, isredirect = 0, rval = -1;
-	int isunavail = 0, retryafter = -1;
-	struct addrinfo hints, *res0, *res;
-	char *proxyurl = NULL;
-	char *credentials = NULL, *proxy_credentials = NULL;
-	int fd = -1, out = -1;
-	volatile sig_t oldintr, oldinti;
-	FILE *fin = NULL;
-	const char *errstr;
-	ssize_t len;
-	char *proxyhost = NULL;
-	char *sslpath = NULL, *sslhost = NULL;
-	int ishttpsurl = 0;
-	char *full_host = NULL;
-	const char *scheme;
-	char *locbase;
-	struct tls *tls = NULL;
-	int status;
-	int save_errno;
-	const size_t buflen = 128 * 1024;
-	int chunked = 0;
-
-	char *httpsport = "443";
-	char *httpport = "80";
-	off_t filesize;
-	int family = PF_UNSPEC;
-	char *httpuseragent = "User-Agent: " USER_AGENT;
-	off_t bytes;
-	struct tls_config *tls_config = NULL;
+http_stale(struct http_connection *conn)
+{
+	return conn->reused && conn->bufpos == conn->bufoff &&
+	    (conn->state == STATE_REQUEST ||
+	    conn->state == STATE_RESPONSE_STATUS);
+}
 
-	newline = xstrdup(origline);
-	if (strncasecmp(newline, HTTPS_URL, sizeof(HTTPS_URL) - 1) != 0) {
-		warnx("%s: URL not permitted", newline);
-		goto cleanup_url_get;
+/*
+ * Append the request line and headers of req to the write buffer.
+ */
+static void
+http_request_append(struct http_connection *conn, struct http_request *req)
+{
+	char *host, *msg, *wbuf;
+
+	log_info("Requesting %s\n", req->uri);
+	host = http_authority(req->host, req->port, HTTPS_PORT);
+	/* byte ranges refer to the uncompressed document */
+	if (asprintf(&msg, "%s /%s HTTP/1.1\r\n"
+	    "Host: %s\r\n%s\r\n%s%s%s\r\n", req->data->head ? "HEAD" : "GET",
+	    req->path, host, httpuseragent, req->data->opts->compress &&
+	    req->range == NULL && !req->data->head ? httpacceptenc : "",
+	    req->conditional != NULL ? req->conditional : "",
+	    req->range != NULL ? req->range : "") == -1)
+		fatal("%s - asprintf", __func__);
+	free(host);
+	if (conn->wbuf == NULL) {
+		conn->wbuf = msg;
+		conn->wbuflen = strlen(msg);
+	} else {
+		if (asprintf(&wbuf, "%s%s", conn->wbuf, msg) == -1)
+			fatal("%s - asprintf", __func__);
+		free(conn->wbuf);
+		free(msg);
+		conn->wbuf = wbuf;
+		conn->wbuflen = strlen(wbuf);
 	}
-	host = newline + sizeof(HTTPS_URL) - 1;
-	scheme = HTTPS_URL;
+	req->sent = 1;
+}
+
+/*
+ * Write req and all queued requests that were not sent yet in one go.
+ */
+static void
+http_request_prepare(struct http_connection *conn)
+{
+	struct http_request *req;
+
+	free(conn->wbuf);
+	conn->wbuf = NULL;
+	if (!conn->req->sent)
+		http_request_append(conn, conn->req);
+	TAILQ_FOREACH(req, &conn->queue, entry)
+		if (!req->sent)
+			http_request_append(conn, req);
+	conn->wbufpos = 0;
+	conn->timeout = getmonotime() + RESPONSE_TIMEOUT * 1000LL;
+	if (conn->wbuf == NULL)
+		conn->state = STATE_RESPONSE_STATUS;
+	else
+		conn->state = STATE_REQUEST;
+}
 
-	path = strchr(host, '/');
+static void
+http_proxy_prepare(struct http_connection *conn)
+{
+	char *host;
+	int l;
 
-	if (EMPTYSTRING(path))
-		path = strchr(host,'\0');
+	host = http_authority(conn->host, conn->port, NULL);
+	free(conn->wbuf);
+	if (conn->proxyauth != NULL)
+		l = asprintf(&conn->wbuf, "CONNECT %s HTTP/1.1\r\n"
+		    "Host: %s\r\nProxy-Authorization: Basic %s\r\n%s\r\n\r\n",
+		    host, host, conn->proxyauth, httpuseragent);
 	else
-		*path++ = '\0';
-
-	if (proxyenv != NULL) {		/* use proxy */
-		sslpath = strdup(path);
-		sslhost = strdup(host);
-		if (! sslpath || ! sslhost)
-			fatal("Can't allocate memory for https path/host.");
-		proxyhost = strdup(host);
-		if (proxyhost == NULL)
-			fatal("Can't allocate memory for proxy host.");
-		proxyurl = strdup(proxyenv);
-		if (proxyurl == NULL)
-			fatal("Can't allocate memory for proxy URL.");
-		if (strncasecmp(proxyurl, HTTP_URL, sizeof(HTTP_URL) - 1) == 0)
-			host = proxyurl + sizeof(HTTP_URL) - 1;
-		else {
-			warnx("Malformed proxy URL: %s", proxyenv);
-			goto cleanup_url_get;
-		}
-		if (EMPTYSTRING(host)) {
-			warnx("Malformed proxy URL: %s", proxyenv);
-			goto cleanup_url_get;
-		}
-		if (*--path == '\0')
-			*path = '/';		/* add / back to real path */
-		path = strchr(host, '/');	/* remove trailing / on host */
-		if (!EMPTYSTRING(path))
-			*path++ = '\0';		/* i guess this ++ is useless */
-
-		path = strchr(host, '@');	/* look for proxy credentials */
-		if (!EMPTYSTRING(path)) {
-			*path = '\0';
-			if (strchr(host, ':') == NULL) {
-				warnx("Malformed proxy URL: %s", proxyenv);
-				goto cleanup_url_get;
-			}
-			proxy_credentials = recode_credentials(host);
-			*path = '@'; /* restore @ in proxyurl */
-
-			/*
-			 * This removes the password from proxyurl,
-			 * filling with stars
-			 */
-			for (host = 1 + strchr(proxyurl + 5, ':');  *host != '@';
-			    host++)
-				*host = '*';
-
-			host = path + 1;
-		}
+		l = asprintf(&conn->wbuf, "CONNECT %s HTTP/1.1\r\n"
+		    "Host: %s\r\n%s\r\n\r\n", host, host, httpuseragent);
+	if (l == -1)
+		fatal("Could not allocate memory to assemble connect string!");
+	free(host);
+	conn->wbuflen = l;
+	conn->wbufpos = 0;
+	conn->timeout = getmonotime() + HANDSHAKE_TIMEOUT * 1000LL;
+	conn->state = STATE_PROXY_REQUEST;
+}
 
-		path = newline;
-	}
+static void
+http_addrstr(struct http_addr *addr, char *hbuf, size_t len)
+{
+	if (getnameinfo((struct sockaddr *)&addr->ss, addr->len, hbuf, len,
+	    NULL, 0, NI_NUMERICHOST) != 0)
+		strlcpy(hbuf, "(unknown)", len);
+}
 
-	if (*host == '[' && (hosttail = strrchr(host, ']')) != NULL &&
-	    (hosttail[1] == '\0' || hosttail[1] == ':')) {
-		host++;
-		*hosttail++ = '\0';
-		if (asprintf(&full_host, "[%s]", host) == -1)
-			fatal("Cannot allocate memory for hostname");
-	} else
-		hosttail = host;
+static void
+http_addr_set(struct http_addr *addr, struct addrinfo *res)
+{
+	memcpy(&addr->ss, res->ai_addr, res->ai_addrlen);
+	addr->len = res->ai_addrlen;
+}
 
-	portnum = strrchr(hosttail, ':');		/* find portnum */
-	if (portnum != NULL)
-		*portnum++ = '\0';
-	port = portnum ? portnum : httpsport;
+static struct http_endpoint *
+http_endpoint_find(const char *target)
+{
+	struct http_endpoint *ep;
+
+	TAILQ_FOREACH(ep, &endpoints, entry)
+		if (strcmp(ep->target, target) == 0)
+			return ep->expires > time(NULL) ? ep : NULL;
+	return NULL;
+}
 
-	if (full_host == NULL)
-		full_host = xstrdup(host);
-	log_debug("host %s, port %s, path %s, "
-	    "auth %s.\n", host, port, path,
-	    credentials ? credentials : "none");
+static void
+http_endpoint_free(struct http_endpoint *ep)
+{
+	TAILQ_REMOVE(&endpoints, ep, entry);
+	free(ep->target);
+	free(ep);
+}
 
+/*
+ * Read the endpoints file of the cachedir, lines of
+ * "host:port address expires failures". In batch mode every cachedir
+ * adds to the same endpoints, the most recent entry for a host wins.
+ */
+void
+http_load_endpoints(struct opts *opts)
+{
+	struct http_endpoint *ep;
+	struct addrinfo hints, *res;
+	FILE *f;
+	char *line = NULL, *s, *target, *addr, *port;
+	size_t len = 0;
+	long long expires;
+	int fd, failures, error;
+
+	fd = openat(opts->primary_dir, ENDPOINT_FILENAME, O_RDONLY);
+	if (fd == -1 || (f = fdopen(fd, "r")) == NULL) {
+		if (fd != -1)
+			close(fd);
+		return;
+	}
 	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = family;
+	hints.ai_family = PF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
-	error = getaddrinfo(host, port, &hints, &res0);
-	/*
-	 * If the services file is corrupt/missing, fall back
-	 * on our hard-coded defines.
-	 */
-	if (error == EAI_SERVICE && port == httpport) {
-		snprintf(pbuf, sizeof(pbuf), "%d", HTTP_PORT);
-		error = getaddrinfo(host, pbuf, &hints, &res0);
-	} else if (error == EAI_SERVICE && port == httpsport) {
-		snprintf(pbuf, sizeof(pbuf), "%d", HTTPS_PORT);
-		error = getaddrinfo(host, pbuf, &hints, &res0);
-	}
-	if (error) {
-		warnx("%s: %s", host, gai_strerror(error));
-		goto cleanup_url_get;
-	}
-
-	fd = -1;
-	for (res = res0; res; res = res->ai_next) {
-		if (getnameinfo(res->ai_addr, res->ai_addrlen, hbuf,
-		    sizeof(hbuf), NULL, 0, NI_NUMERICHOST) != 0)
-			strlcpy(hbuf, "(unknown)", sizeof(hbuf));
-		log_info("Trying %s...\n", hbuf);
-
-		fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-		if (fd == -1) {
-			cause = "socket";
+	hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+	while (getline(&line, &len, f) != -1) {
+		s = line;
+		target = strsep(&s, " ");
+		addr = strsep(&s, " ");
+		if (s == NULL || sscanf(s, "%lld %d", &expires,
+		    &failures) != 2 || (port = strrchr(target, ':')) == NULL) {
+			log_warnx("%s: bad entry", ENDPOINT_FILENAME);
 			continue;
 		}
-
-		if (connect_timeout) {
-			(void)signal(SIGALRM, tooslow);
-			alarmtimer(connect_timeout);
-		}
-
-		for (error = connect(fd, res->ai_addr, res->ai_addrlen);
-		    error != 0 && errno == EINTR; error = connect_wait(fd))
+		if (expires <= time(NULL) ||
+		    failures >= ENDPOINT_MAX_FAILURES)
 			continue;
-		if (error != 0) {
-			save_errno = errno;
-			close(fd);
-			errno = save_errno;
-			fd = -1;
-			cause = "connect";
+		TAILQ_FOREACH(ep, &endpoints, entry)
+			if (strcmp(ep->target, target) == 0)
+				break;
+		if (ep != NULL && ep->expires >= expires)
+			continue;
+		if ((error = getaddrinfo(addr, port + 1, &hints, &res)) != 0) {
+			log_warnx("%s: %s: %s", ENDPOINT_FILENAME, addr,
+			    gai_strerror(error));
 			continue;
 		}
+		if (ep == NULL) {
+			if ((ep = calloc(1, sizeof(*ep))) == NULL)
+				fatal("%s - calloc", __func__);
+			ep->target = xstrdup(target);
+			TAILQ_INSERT_TAIL(&endpoints, ep, entry);
+		}
+		http_addr_set(&ep->addr, res);
+		ep->expires = expires;
+		ep->failures = failures;
+		freeaddrinfo(res);
+	}
+	free(line);
+	fclose(f);
+}
 
-		/* get port in numeric */
-		if (getnameinfo(res->ai_addr, res->ai_addrlen, NULL, 0,
-		    pbuf, sizeof(pbuf), NI_NUMERICSERV) == 0)
-			port = pbuf;
-		else
-			port = NULL;
+static void
+http_endpoint_connected(struct http_connection *conn, struct http_addr *addr)
+{
+	struct http_endpoint *ep;
 
-		if (proxyenv && sslhost)
-			proxy_connect(fd, sslhost, proxy_credentials);
-		break;
-	}
-	freeaddrinfo(res0);
-	if (fd < 0) {
-		warn("%s", cause);
-		goto cleanup_url_get;
+	TAILQ_FOREACH(ep, &endpoints, entry)
+		if (strcmp(ep->target, conn->target) == 0)
+			break;
+	if (ep == NULL) {
+		if ((ep = calloc(1, sizeof(*ep))) == NULL)
+			fatal("%s - calloc", __func__);
+		ep->target = xstrdup(conn->target);
+		TAILQ_INSERT_TAIL(&endpoints, ep, entry);
 	}
+	ep->addr = *addr;
+	ep->expires = time(NULL) + ENDPOINT_TTL;
+	ep->failures = 0;
+}
 
-	ssize_t ret;
-	if (proxyenv && sslpath) {
-		ishttpsurl = 0;
-		proxyurl = NULL;
-		path = sslpath;
-	}
-	if (sslhost == NULL) {
-		sslhost = xstrdup(host);
+static void
+http_endpoint_failed(struct http_connection *conn)
+{
+	struct http_endpoint *ep;
+
+	if ((ep = http_endpoint_find(conn->target)) == NULL)
+		return;
+	if (++ep->failures >= ENDPOINT_MAX_FAILURES)
+		http_endpoint_free(ep);
+}
+
+/*
+ * Write the endpoints back to the cachedir. This is done at the very end,
+ * a snapshot replaces everything in there.
+ */
+void
+http_save_endpoints(struct opts *opts)
+{
+	struct http_endpoint *ep;
+	char hbuf[NI_MAXHOST];
+	FILE *f;
+	int fd;
+
+	fd = openat(opts->primary_dir, ENDPOINT_FILENAME,
+	    O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+	if (fd == -1 || (f = fdopen(fd, "w")) == NULL) {
+		log_warn("%s - open %s", __func__, ENDPOINT_FILENAME);
+		if (fd != -1)
+			close(fd);
+		return;
 	}
-	if ((tls = tls_client()) == NULL) {
-		log_warnx("failed to create SSL client\n");
-		goto cleanup_url_get;
+	TAILQ_FOREACH(ep, &endpoints, entry) {
+		http_addrstr(&ep->addr, hbuf, sizeof(hbuf));
+		fprintf(f, "%s %s %lld %d\n", ep->target, hbuf,
+		    (long long)ep->expires, ep->failures);
 	}
-	if (tls_configure(tls, tls_config) != 0) {
-		log_warnx("TLS configuration failure: %s\n",
-		    tls_error(tls));
-		goto cleanup_url_get;
+	if (fclose(f) == EOF)
+		log_warn("%s - write %s", __func__, ENDPOINT_FILENAME);
+}
+
+static struct http_dns *
+http_dns_find(const char *target)
+{
+	struct http_dns *dns;
+
+	TAILQ_FOREACH(dns, &dns_cache, entry)
+		if (strcmp(dns->target, target) == 0)
+			return dns->expires > getmonotime() ? dns : NULL;
+	return NULL;
+}
+
+/*
+ * Keep the resolver result for target. The address families alternate,
+ * starting with the one the resolver put first, so a dead IPv6 path only
+ * holds back the first IPv4 address by ATTEMPT_DELAY (RFC 8305,
+ * section 4).
+ */
+static struct http_dns *
+http_dns_store(const char *target, struct addrinfo *res0)
+{
+	struct http_dns *dns;
+	struct addrinfo *res, *first = res0, *other = res0;
+	size_t n = 0;
+
+	TAILQ_FOREACH(dns, &dns_cache, entry)
+		if (strcmp(dns->target, target) == 0)
+			break;
+	if (dns == NULL) {
+		if ((dns = calloc(1, sizeof(*dns))) == NULL)
+			fatal("%s - calloc", __func__);
+		dns->target = xstrdup(target);
+		TAILQ_INSERT_TAIL(&dns_cache, dns, entry);
 	}
-	if (tls_connect_socket(tls, fd, sslhost) != 0) {
-		log_warnx("TLS connect failure: %s\n", tls_error(tls));
-		goto cleanup_url_get;
+	for (res = res0; res != NULL; res = res->ai_next)
+		n++;
+	free(dns->addrs);
+	if ((dns->addrs = calloc(n, sizeof(*dns->addrs))) == NULL)
+		fatal("%s - calloc", __func__);
+	dns->naddrs = 0;
+	while (dns->naddrs < n) {
+		while (first != NULL && first->ai_family != res0->ai_family)
+			first = first->ai_next;
+		if (first != NULL) {
+			http_addr_set(&dns->addrs[dns->naddrs++], first);
+			first = first->ai_next;
+		}
+		while (other != NULL && other->ai_family == res0->ai_family)
+			other = other->ai_next;
+		if (other != NULL) {
+			http_addr_set(&dns->addrs[dns->naddrs++], other);
+			other = other->ai_next;
+		}
 	}
-	do {
-		ret = tls_handshake(tls);
-	} while (ret == TLS_WANT_POLLIN || ret == TLS_WANT_POLLOUT);
-	if (ret != 0) {
-		log_warnx("TLS handshake failure: %s\n", tls_error(tls));
-		goto cleanup_url_get;
+	dns->expires = getmonotime() + DNS_CACHE_TTL * 1000LL;
+	return dns;
+}
+
+/*
+ * Give conn its own copy of the addresses to try. The address that
+ * connected last time goes first.
+ */
+static void
+http_set_addrs(struct http_connection *conn, struct http_addr *addrs,
+    size_t naddrs)
+{
+	struct http_endpoint *ep;
+	size_t i;
+
+	free(conn->addrs);
+	if ((conn->addrs = reallocarray(NULL, naddrs,
+	    sizeof(*addrs))) == NULL)
+		fatal("%s - reallocarray", __func__);
+	memcpy(conn->addrs, addrs, naddrs * sizeof(*addrs));
+	conn->naddrs = naddrs;
+	conn->nextaddr = 0;
+
+	if ((ep = http_endpoint_find(conn->target)) == NULL)
+		return;
+	for (i = 0; i < naddrs; i++)
+		if (addrs[i].len == ep->addr.len &&
+		    memcmp(&addrs[i].ss, &ep->addr.ss, ep->addr.len) == 0)
+			break;
+	if (i == naddrs)
+		return;
+	memmove(conn->addrs + 1, conn->addrs, i * sizeof(*addrs));
+	conn->addrs[0] = addrs[i];
+}
+
+static enum res
+http_resolve(struct http_connection *conn)
+{
+	struct http_endpoint *ep;
+	struct http_dns *dns;
+	struct addrinfo hints;
+	struct asr_result ar;
+
+	if (conn->asq == NULL) {
+		if ((dns = http_dns_find(conn->target)) != NULL) {
+			http_set_addrs(conn, dns->addrs, dns->naddrs);
+			return http_connect(conn);
+		}
+		if (!conn->triedendpoint &&
+		    (ep = http_endpoint_find(conn->target)) != NULL) {
+			log_debug("trying last endpoint of %s", conn->target);
+			conn->triedendpoint = conn->fromendpoint = 1;
+			http_set_addrs(conn, &ep->addr, 1);
+			return http_connect(conn);
+		}
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = PF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		conn->asq = getaddrinfo_async(conn->proxyhost != NULL ?
+		    conn->proxyhost : conn->host, conn->proxyhost != NULL ?
+		    conn->proxyport : conn->port, &hints, NULL);
+		if (conn->asq == NULL) {
+			warn("%s: getaddrinfo_async", conn->host);
+			return FAILED;
+		}
 	}
-	fin = funopen(tls, stdio_tls_read_wrapper,
-	    stdio_tls_write_wrapper, NULL, NULL);
 
-	if (connect_timeout) {
-		signal(SIGALRM, SIG_DFL);
-		alarmtimer(0);
+	if (asr_run(conn->asq, &ar) == 0) {
+		conn->pfd = ar.ar_fd;
+		conn->deadline = getmonotime() + ar.ar_timeout;
+		return ar.ar_cond == ASR_WANT_READ ? WANT_POLLIN : WANT_POLLOUT;
+	}
+	conn->asq = NULL;
+	conn->pfd = -1;
+	conn->deadline = 0;
+	if (ar.ar_gai_errno != 0) {
+		warnx("%s: %s", conn->proxyhost != NULL ? conn->proxyhost :
+		    conn->host, gai_strerror(ar.ar_gai_errno));
+		return FAILED;
 	}
+	dns = http_dns_store(conn->target, ar.ar_addrinfo);
+	freeaddrinfo(ar.ar_addrinfo);
+	http_set_addrs(conn, dns->addrs, dns->naddrs);
+	return http_connect(conn);
+}
 
-	/*
-	 * Construct and send the request. Proxy requests don't want leading /.
-	 */
-	epath = url_encode(path);
-	if (proxyurl) {
-		log_info("Requesting %s (via %s)\n", origline, proxyurl);
-		/*
-		 * Host: directive must use the destination host address for
-		 * the original URI (path).
-		 */
-		fprintf(fin, "GET %s HTTP/1.1\r\n"
-		    "Connection: close\r\n"
-		    "Host: %s\r\n%s\r\n",
-		    epath, proxyhost, httpuseragent);
-		if (credentials)
-			fprintf(fin, "Authorization: Basic %s\r\n",
-			    credentials);
-		if (modified_since)
-			fprintf(fin, "%s\r\n", modified_since);
-		if (proxy_credentials)
-			fprintf(fin, "Proxy-Authorization: Basic %s\r\n",
-			    proxy_credentials);
-		fprintf(fin, "\r\n");
-	} else {
-		log_info("Requesting %s\n", origline);
-		fprintf(fin,
-		    "GET /%s HTTP/1.1\r\n"
-		    "Connection: close\r\n"
-		    "Host: ", epath);
-		if (proxyhost) {
-			fprintf(fin, "%s", proxyhost);
-			port = NULL;
-		} else if (strchr(host, ':')) {
-			/*
-			 * strip off scoped address portion, since it's
-			 * local to node
-			 */
-			h = xstrdup(host);
-			if ((p = strchr(h, '%')) != NULL)
-				*p = '\0';
-			fprintf(fin, "[%s]", h);
-			free(h);
-		} else
-			fprintf(fin, "%s", host);
+/*
+ * All configurations get the same protocol and cipher settings and the CA
+ * bundle read by http_init(), nothing is read from disk when connecting.
+ * tls_config_set_ca_mem() keeps a copy of the bundle for each host and
+ * libtls still parses it for every connection.
+ */
+static struct tls_config *
+http_tls_config_new(void)
+{
+	struct tls_config *config;
+
+	if ((config = tls_config_new()) == NULL)
+		fatal("%s - tls_config_new", __func__);
+	if (tls_config_set_ca_mem(config, tls_ca_mem, tls_ca_size) == -1 ||
+	    tls_config_set_protocols(config, TLS_PROTOCOLS_DEFAULT) == -1 ||
+	    tls_config_set_ciphers(config, "secure") == -1)
+		fatalx("%s - %s", __func__, tls_config_error(config));
+	return config;
+}
 
-		/*
-		 * Send port number only if it's specified and does not equal
-		 * 80. Some broken HTTP servers get confused if you explicitly
-		 * send them the port number.
-		 */
-		if (port && strcmp(port, "443") != 0)
-			fprintf(fin, ":%s", port);
-		fprintf(fin, "\r\n%s\r\n", httpuseragent);
-		if (credentials)
-			fprintf(fin, "Authorization: Basic %s\r\n",
-			    credentials);
-		if (modified_since)
-			fprintf(fin, "%s\r\n", modified_since);
-		fprintf(fin, "\r\n");
+static struct tls_config *
+http_tls_config(struct http_connection *conn)
+{
+	struct opts *opts = conn->req->data->opts;
+	struct tls_host *th;
+	char *key, name[PATH_MAX];
+
+	if (asprintf(&key, "%s:%s", conn->host, conn->port) == -1)
+		fatal("%s - asprintf", __func__);
+	TAILQ_FOREACH(th, &tls_hosts, entry)
+		if (strcmp(th->key, key) == 0) {
+			free(key);
+			return th->config;
+		}
+
+	if ((th = calloc(1, sizeof(*th))) == NULL)
+		fatal("%s - calloc", __func__);
+	th->key = key;
+	th->config = http_tls_config_new();
+	TAILQ_INSERT_TAIL(&tls_hosts, th, entry);
+
+	snprintf(name, sizeof(name), "%s%s", TLS_SESSION_FILENAME, key);
+	th->fd = openat(opts->primary_dir, name, O_RDWR|O_CREAT|
+	    (opts->save_sessions ? 0 : O_TRUNC), S_IRUSR|S_IWUSR);
+	if (th->fd == -1) {
+		log_warn("%s - open %s", __func__, name);
+		return th->config;
+	}
+	if (!opts->save_sessions && unlinkat(opts->primary_dir, name, 0) == -1)
+		log_warn("%s - unlink %s", __func__, name);
+	if (tls_config_set_session_fd(th->config, th->fd) == -1) {
+		log_warnx("%s: %s", name, tls_config_error(th->config));
+		close(th->fd);
+		th->fd = -1;
 	}
-	free(epath);
+	return th->config;
+}
 
-	if (fflush(fin) == EOF) {
-		warnx("Writing HTTP request: %s", sockerror(tls));
-		goto cleanup_url_get;
+static enum res
+http_tls_connect(struct http_connection *conn)
+{
+	if ((conn->tls = tls_client()) == NULL) {
+		log_warnx("failed to create SSL client\n");
+		return FAILED;
+	}
+	if (tls_configure(conn->tls, http_tls_config(conn)) != 0) {
+		log_warnx("TLS configuration failure: %s\n",
+		    tls_error(conn->tls));
+		return FAILED;
 	}
-	if ((buf = ftp_readline(fin, &len)) == NULL) {
-		warnx("Receiving HTTP reply: %s", sockerror(tls));
-		goto cleanup_url_get;
+	if (tls_connect_socket(conn->tls, conn->fd, conn->host) != 0) {
+		log_warnx("TLS connect failure: %s\n", tls_error(conn->tls));
+		return FAILED;
 	}
+	conn->timeout = getmonotime() + HANDSHAKE_TIMEOUT * 1000LL;
+	conn->state = STATE_TLSCONNECT;
+	return DONE;
+}
 
-	while (len > 0 && (buf[len-1] == '\r' || buf[len-1] == '\n'))
-		buf[--len] = '\0';
-	log_debug("received '%s'\n", buf);
+static enum res
+http_tls_handshake(struct http_connection *conn)
+{
+	switch (tls_handshake(conn->tls)) {
+	case TLS_WANT_POLLIN:
+		return WANT_POLLIN;
+	case TLS_WANT_POLLOUT:
+		return WANT_POLLOUT;
+	case 0:
+		if (tls_conn_session_resumed(conn->tls))
+			log_debug("resumed TLS session with %s", conn->host);
+		http_request_prepare(conn);
+		return DONE;
+	default:
+		log_warnx("TLS handshake failure: %s\n", tls_error(conn->tls));
+		return FAILED;
+	}
+}
+
+static void
+http_attempts_close(struct http_connection *conn)
+{
+	while (conn->nattempts > 0)
+		close(conn->attempts[--conn->nattempts].fd);
+}
+
+static enum res
+http_connected(struct http_connection *conn, int fd, struct http_addr *addr)
+{
+	http_endpoint_connected(conn, addr);
+	http_attempts_close(conn);
+	conn->fd = conn->pfd = fd;
+	conn->deadline = 0;
+	free(conn->addrs);
+	conn->addrs = NULL;
+	conn->naddrs = conn->nextaddr = 0;
+	if (conn->proxyhost != NULL) {
+		http_proxy_prepare(conn);
+		return DONE;
+	}
+	return http_tls_connect(conn);
+}
+
+/*
+ * Wake up for the earliest connect timeout or the next attempt.
+ */
+static void
+http_connect_deadline(struct http_connection *conn)
+{
+	struct http_attempt *at;
+	int i;
+
+	conn->deadline = 0;
+	if (conn->nextaddr < conn->naddrs && conn->nattempts < MAX_ATTEMPTS)
+		conn->deadline = conn->nextattempt;
+	for (i = 0; i < conn->nattempts; i++) {
+		at = &conn->attempts[i];
+		if (at->deadline != 0 && (conn->deadline == 0 ||
+		    at->deadline < conn->deadline))
+			conn->deadline = at->deadline;
+	}
+}
+
+/*
+ * Start a non-blocking connect to the next address of the host. Earlier
+ * attempts keep running and the first socket to connect is used.
+ */
+static enum res
+http_connect(struct http_connection *conn)
+{
+	char hbuf[NI_MAXHOST];
+	struct http_attempt *at;
+	struct http_addr *addr;
+	long long now = getmonotime();
+	int fd;
+
+	while (conn->nextaddr < conn->naddrs &&
+	    conn->nattempts < MAX_ATTEMPTS) {
+		addr = &conn->addrs[conn->nextaddr++];
+		http_addrstr(addr, hbuf, sizeof(hbuf));
+		log_info("Trying %s...\n", hbuf);
+
+		fd = socket(addr->ss.ss_family, SOCK_STREAM | SOCK_NONBLOCK,
+		    0);
+		if (fd == -1) {
+			warn("socket");
+			continue;
+		}
+		if (connect(fd, (struct sockaddr *)&addr->ss, addr->len) == 0)
+			return http_connected(conn, fd, addr);
+		if (errno != EINPROGRESS) {
+			warn("connect %s", hbuf);
+			close(fd);
+			continue;
+		}
+		at = &conn->attempts[conn->nattempts++];
+		at->addr = addr;
+		at->fd = fd;
+		at->revents = 0;
+		if (conn->fromendpoint)
+			at->deadline = now + ENDPOINT_TIMEOUT;
+		else
+			at->deadline = connect_timeout ?
+			    now + connect_timeout * 1000LL : 0;
+		conn->nextattempt = now + ATTEMPT_DELAY;
+		break;
+	}
+	if (conn->nattempts == 0 && conn->fromendpoint) {
+		/* the address from last time is gone, ask the resolver */
+		http_endpoint_failed(conn);
+		conn->fromendpoint = 0;
+		conn->state = STATE_RESOLVE;
+		return DONE;
+	}
+	if (conn->nattempts == 0) {
+		warnx("%s: no more addresses to try", conn->proxyhost != NULL ?
+		    conn->proxyhost : conn->host);
+		return FAILED;
+	}
+	conn->state = STATE_CONNECT;
+	http_connect_deadline(conn);
+	return WANT_POLLOUT;
+}
 
-	cp = strchr(buf, ' ');
-	if (cp == NULL)
-		goto improper;
+/*
+ * One of the sockets became writable, an attempt timed out or it is
+ * time to try the next address.
+ */
+static enum res
+http_finish_connect(struct http_connection *conn)
+{
+	char hbuf[NI_MAXHOST];
+	struct http_attempt *at;
+	struct http_addr *addr;
+	long long now = getmonotime();
+	socklen_t len;
+	int i = 0, error, fd, failed = 0;
+
+	while (i < conn->nattempts) {
+		at = &conn->attempts[i];
+		error = 0;
+		if (at->revents != 0) {
+			len = sizeof(error);
+			if (getsockopt(at->fd, SOL_SOCKET, SO_ERROR, &error,
+			    &len) == -1)
+				error = errno;
+			if (error == 0) {
+				fd = at->fd;
+				addr = at->addr;
+				*at = conn->attempts[--conn->nattempts];
+				return http_connected(conn, fd, addr);
+			}
+		} else if (at->deadline != 0 && now >= at->deadline)
+			error = ETIMEDOUT;
+		if (error == 0) {
+			i++;
+			continue;
+		}
+		http_addrstr(at->addr, hbuf, sizeof(hbuf));
+		errno = error;
+		warn("connect %s", hbuf);
+		close(at->fd);
+		*at = conn->attempts[--conn->nattempts];
+		failed = 1;
+	}
+	/* a failed attempt makes way for the next address right away */
+	if (failed || now >= conn->nextattempt)
+		return http_connect(conn);
+	http_connect_deadline(conn);
+	return WANT_POLLOUT;
+}
+
+static enum res
+http_write(struct http_connection *conn)
+{
+	ssize_t s;
+
+	while (conn->wbufpos < conn->wbuflen) {
+		if (conn->tls != NULL) {
+			s = tls_write(conn->tls, conn->wbuf + conn->wbufpos,
+			    conn->wbuflen - conn->wbufpos);
+			if (s == TLS_WANT_POLLIN)
+				return WANT_POLLIN;
+			if (s == TLS_WANT_POLLOUT)
+				return WANT_POLLOUT;
+			if (s == -1) {
+				if (!http_stale(conn))
+					warnx("%s: TLS write: %s", conn->host,
+					    tls_error(conn->tls));
+				return FAILED;
+			}
+		} else {
+			s = write(conn->fd, conn->wbuf + conn->wbufpos,
+			    conn->wbuflen - conn->wbufpos);
+			if (s == -1) {
+				if (errno == EAGAIN || errno == EINTR)
+					return WANT_POLLOUT;
+				warn("%s: write", conn->proxyhost);
+				return FAILED;
+			}
+		}
+		conn->wbufpos += s;
+	}
+	free(conn->wbuf);
+	conn->wbuf = NULL;
+	if (conn->state == STATE_PROXY_REQUEST)
+		conn->state = STATE_PROXY_STATUS;
 	else
-		cp++;
+		conn->state = STATE_RESPONSE_STATUS;
+	return DONE;
+}
+
+/*
+ * Read up to len bytes from the connection into buf, *sp is set to the
+ * number of bytes read.
+ */
+static enum res
+http_recv(struct http_connection *conn, char *buf, size_t len, ssize_t *sp)
+{
+	ssize_t s;
+
+	*sp = 0;
+	if (conn->tls != NULL) {
+		s = tls_read(conn->tls, buf, len);
+		if (s == TLS_WANT_POLLIN)
+			return WANT_POLLIN;
+		if (s == TLS_WANT_POLLOUT)
+			return WANT_POLLOUT;
+		if (s == -1) {
+			if (!http_stale(conn))
+				warnx("%s: TLS read: %s", conn->host,
+				    tls_error(conn->tls));
+			return FAILED;
+		}
+	} else {
+		s = read(conn->fd, buf, len);
+		if (s == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				return WANT_POLLIN;
+			warn("%s: read", conn->proxyhost);
+			return FAILED;
+		}
+	}
+	if (s == 0) {
+		/* without framing the body ends with the connection */
+		if (conn->state == STATE_RESPONSE_DATA && conn->iosz == -1) {
+			conn->eof = 1;
+			return DONE;
+		}
+		if (!http_stale(conn))
+			warnx("%s: connection closed unexpectedly",
+			    conn->host);
+		return FAILED;
+	}
+	*sp = s;
+	if (conn->req != NULL) {
+		conn->req->data->opts->received += s;
+		conn->req->window += s;
+	}
+	/* the response has started, from now on only stalls count */
+	if (conn->state >= STATE_RESPONSE_STATUS && conn->state < STATE_IDLE)
+		conn->timeout = getmonotime() + IDLE_TIMEOUT * 1000LL;
+	return DONE;
+}
+
+/*
+ * Append more data from the connection to the receive buffer.
+ */
+static enum res
+http_read(struct http_connection *conn)
+{
+	enum res res;
+	ssize_t s;
+
+	/* only a partial line can be left, move it to the front */
+	if (conn->bufoff > 0) {
+		conn->bufpos -= conn->bufoff;
+		memmove(conn->buf, conn->buf + conn->bufoff, conn->bufpos);
+		conn->bufoff = 0;
+	}
+	if (conn->bufpos == HTTP_BUF_SIZE) {
+		warnx("%s: header line too long", conn->host);
+		return FAILED;
+	}
+	res = http_recv(conn, conn->buf + conn->bufpos,
+	    HTTP_BUF_SIZE - conn->bufpos, &s);
+	conn->bufpos += s;
+	return res;
+}
+
+/*
+ * Return the next line of the receive buffer without the line ending,
+ * or NULL if no complete line has been received yet. The line is
+ * terminated in place and valid until the next read.
+ */
+static char *
+http_get_line(struct http_connection *conn)
+{
+	char *line = conn->buf + conn->bufoff, *end;
+
+	if ((end = memchr(line, '\n', conn->bufpos - conn->bufoff)) == NULL)
+		return NULL;
+	conn->bufoff = end + 1 - conn->buf;
+	*end = '\0';
+	while (end > line && end[-1] == '\r')
+		*--end = '\0';
+	return line;
+}
+
+/*
+ * Detach the request from conn, which is closed, and send it again.
+ */
+static void
+http_req_restart(struct http_connection *conn)
+{
+	struct http_request *req = conn->req;
+
+	conn->req = NULL;
+	req->conn = NULL;
+	req->deadline = 0;
+	conn->state = STATE_CLOSE;
+	http_req_start(req);
+}
+
+static enum res
+http_done(struct http_connection *conn)
+{
+	struct http_request *req;
+
+	if (conn->zs != NULL) {
+		if (!conn->zdone) {
+			warnx("%s: compressed body is truncated", conn->host);
+			return FAILED;
+		}
+		http_zfree(conn);
+	}
+	http_req_done(conn->req, conn->status);
+	conn->req = NULL;
+	/*
+	 * A cancelled request already went out and its answer would come
+	 * next, the ones still queued are started elsewhere.
+	 */
+	if (conn->closing)
+		conn->state = STATE_CLOSE;
+	else if (conn->keepalive &&
+	    (req = TAILQ_FIRST(&conn->queue)) != NULL) {
+		/* the next response may already be in the buffer */
+		TAILQ_REMOVE(&conn->queue, req, entry);
+		conn->nqueue--;
+		conn->req = req;
+		conn->reused = 1;
+		http_request_prepare(conn);
+	} else if (conn->keepalive && conn->bufpos == conn->bufoff) {
+		conn->bufoff = conn->bufpos = 0;
+		conn->state = STATE_IDLE;
+	} else
+		conn->state = STATE_CLOSE;
+	return DONE;
+}
+
+static enum res
+http_redirect(struct http_connection *conn)
+{
+	struct http_request *req = conn->req;
+	char *loc = conn->redirect, *uri, *authority;
+
+	if (loc == NULL) {
+		warnx("%s: redirect without location", req->uri);
+		return FAILED;
+	}
+	/*
+	 * If there is a colon before the first slash, this URI
+	 * is not relative. RFC 3986 4.2
+	 */
+	if (loc[strcspn(loc, ":/")] != ':') {
+		/* XXX only absolute paths are handled */
+		if (loc[0] != '/' || loc[1] == '/') {
+			warnx("Relative redirect not supported");
+			return FAILED;
+		}
+		authority = http_authority(req->host, req->port, HTTPS_PORT);
+		if (asprintf(&uri, "%s%s%s", HTTPS_URL, authority, loc) == -1)
+			fatalx("Cannot build redirect URL");
+		free(authority);
+	} else
+		uri = xstrdup(loc);
+	uri[strcspn(uri, "#")] = '\0';
+	log_info("Redirected to %s\n", uri);
+	free(req->uri);
+	req->uri = uri;
+	if (http_req_target(req) == -1)
+		return FAILED;
+	http_req_restart(conn);
+	return DONE;
+}
+
+static enum res
+http_parse_status(struct http_connection *conn, char *buf)
+{
+	struct http_request *req = conn->req;
+	char ststr[4], gerror[200], *cp;
+	const char *errstr;
+
+	log_debug("received '%s'\n", buf);
+	conn->keepalive = strncmp(buf, "HTTP/1.1 ", 9) == 0;
+	conn->chunked = 0;
+	conn->iosz = -1;
+	conn->retryafter = -1;
+	free(conn->redirect);
+	conn->redirect = NULL;
+	conn->discard = 0;
+	http_zfree(conn);
+
+	if ((cp = strchr(buf, ' ')) == NULL) {
+		warnx("Improper response from %s", conn->host);
+		return FAILED;
+	}
+	cp++;
 
 	strlcpy(ststr, cp, sizeof(ststr));
-	status = strtonum(ststr, 200, 503, &errstr);
+	conn->status = strtonum(ststr, 200, 503, &errstr);
 	if (errstr) {
 		strnvis(gerror, cp, sizeof gerror, VIS_SAFE);
-		warnx("Error retrieving %s: %s", origline, gerror);
-		goto cleanup_url_get;
+		warnx("Error retrieving %s: %s", req->uri, gerror);
+		return FAILED;
 	}
 
-	switch (status) {
+	switch (conn->status) {
 	case 200:	/* OK */
-		/* FALLTHROUGH */
+		break;
 	case 206:	/* Partial Content */
+		if (req->range == NULL) {
+			warnx("Error retrieving %s: unrequested partial "
+			    "content", req->uri);
+			return FAILED;
+		}
 		break;
 	case 304:	/* See upstream can handle empty 304s */
 		break;
@@ -872,261 +1719,1124 @@ url_get(const char *origline, const char *proxyenv, struct xmldata *data,
 	case 302:	/* Found */
 	case 303:	/* See Other */
 	case 307:	/* Temporary Redirect */
-		isredirect++;
-		if (redirect_loop++ > 10) {
+		if (req->redirects++ > MAX_REDIRECTS) {
 			warnx("Too many redirections requested");
-			goto cleanup_url_get;
+			return FAILED;
 		}
 		break;
 	case 416:	/* Requested Range Not Satisfiable */
-		warnx("File is already fully retrieved.");
-		goto cleanup_url_get;
+		if (req->range == NULL) {
+			warnx("Error retrieving %s: 416 Requested Range Not "
+			    "Satisfiable", req->uri);
+			return FAILED;
+		}
+		/* the caller already has the whole document */
+		log_info("%s is already fully retrieved\n", req->uri);
+		conn->discard = 1;
+		break;
 	case 503:
-		isunavail = 1;
 		break;
 	default:
 		strnvis(gerror, cp, sizeof gerror, VIS_SAFE);
-		warnx("Error retrieving %s: %s", origline, gerror);
-		goto cleanup_url_get;
+		warnx("Error retrieving %s: %s", req->uri, gerror);
+		return FAILED;
 	}
+	conn->state = STATE_RESPONSE_HEADER;
+	return DONE;
+}
 
-	/*
-	 * Read the rest of the header.
-	 */
-	free(buf);
-	filesize = -1;
+static int
+http_isredirect(int status)
+{
+	return status == 301 || status == 302 || status == 303 ||
+	    status == 307;
+}
 
-	for (;;) {
-		if ((buf = ftp_readline(fin, &len)) == NULL) {
-			warnx("Receiving HTTP reply: %s", sockerror(tls));
-			goto cleanup_url_get;
+static enum res
+http_headers_done(struct http_connection *conn)
+{
+	struct http_request *req = conn->req;
+
+	/* Content-Length should be ignored for Transfer-Encoding: chunked */
+	if (conn->chunked)
+		conn->iosz = -1;
+	req->data->length = conn->iosz;
+	/* Neither a 304 nor the answer to a HEAD carry a body */
+	if (conn->status == 304 || req->data->head) {
+		conn->chunked = 0;
+		conn->iosz = 0;
+		http_zfree(conn);
+	}
+	/* Without framing the body ends with the connection */
+	if (!conn->chunked && conn->iosz == -1)
+		conn->keepalive = 0;
+
+	if (http_isredirect(conn->status))
+		return http_redirect(conn);
+	if (conn->status == 503) {
+		if (req->retried || conn->retryafter != 0) {
+			warnx("Error retrieving %s: 503 Service Unavailable",
+			    req->uri);
+			return FAILED;
 		}
+		log_info("Retrying %s\n", req->uri);
+		req->retried = 1;
+		http_req_restart(conn);
+		return DONE;
+	}
 
-		while (len > 0 && (buf[len-1] == '\r' || buf[len-1] == '\n'))
-			buf[--len] = '\0';
-		if (len == 0)
-			break;
+	/* the server ignored the range or the document changed */
+	if (conn->status == 200 && req->range != NULL &&
+	    req->data->spool_fd != -1) {
+		/* the rest of the spool belongs to the other parts */
+		if (req->data->range_end > 0) {
+			warnx("%s: server ignored the range", req->uri);
+			return FAILED;
+		}
+		log_info("Restarting %s from the beginning\n", req->uri);
+		if (ftruncate(req->data->spool_fd, 0) == -1 ||
+		    lseek(req->data->spool_fd, 0, SEEK_SET) == -1) {
+			warn("%s: truncate", req->uri);
+			return FAILED;
+		}
+	}
+
+	/* from here on the body has to keep up a minimum rate */
+	req->deadline = getmonotime() + TRANSFER_WINDOW * 1000LL;
+	req->window = 0;
+	if (conn->chunked)
+		conn->state = STATE_RESPONSE_CHUNKED_HEADER;
+	else
+		conn->state = STATE_RESPONSE_DATA;
+	return DONE;
+}
+
+/*
+ * Set up inflating the body for the given Content-Encoding.
+ */
+static int
+http_zinit(struct http_connection *conn, const char *encoding)
+{
+	if (strcasecmp(encoding, "identity") == 0)
+		return 0;
+	if (strcasecmp(encoding, "gzip") != 0 &&
+	    strcasecmp(encoding, "x-gzip") != 0 &&
+	    strcasecmp(encoding, "deflate") != 0) {
+		warnx("%s: unsupported Content-Encoding %s", conn->host,
+		    encoding);
+		return -1;
+	}
+	http_zfree(conn);
+	if ((conn->zs = calloc(1, sizeof(*conn->zs))) == NULL)
+		fatal("%s - calloc", __func__);
+	if (conn->zbuf == NULL &&
+	    (conn->zbuf = malloc(HTTP_ZBUF_SIZE)) == NULL)
+		fatal("%s - malloc", __func__);
+	/* let zlib detect the gzip or zlib header */
+	if (inflateInit2(conn->zs, MAX_WBITS + 32) != Z_OK)
+		fatalx("%s - inflateInit2", __func__);
+	return 0;
+}
+
+/*
+ * Pass body bytes on to the document consumer, inflating them first if
+ * the body is compressed. The hash is thus taken over the document.
+ */
+static int
+http_deliver(struct http_connection *conn, char *buf, size_t len)
+{
+	struct xmldata *data = conn->req->data;
+	z_stream *zs = conn->zs;
+	char *out;
+	size_t n;
+	int rv;
+
+	if (conn->discard)
+		return 0;
+	if (zs == NULL)
+		return write_callback(buf, 1, len, data) == 0 ? -1 : 0;
+
+	zs->next_in = (Bytef *)buf;
+	zs->avail_in = len;
+	do {
+		if (conn->zdone) {
+			warnx("%s: data after end of compressed body",
+			    conn->host);
+			return -1;
+		}
+		if ((out = xml_buffer(data, HTTP_ZBUF_SIZE)) == NULL)
+			out = conn->zbuf;
+		zs->next_out = (Bytef *)out;
+		zs->avail_out = HTTP_ZBUF_SIZE;
+		rv = inflate(zs, Z_NO_FLUSH);
+		if (rv == Z_STREAM_END)
+			conn->zdone = 1;
+		else if (rv != Z_OK) {
+			warnx("%s: inflate: %s", conn->host,
+			    zs->msg != NULL ? zs->msg : "failed");
+			return -1;
+		}
+		n = HTTP_ZBUF_SIZE - zs->avail_out;
+		if (n > 0 && write_callback(out, 1, n, data) == 0)
+			return -1;
+	} while (zs->avail_in > 0 || zs->avail_out == 0);
+	return 0;
+}
+
+static enum res
+http_parse_header(struct http_connection *conn, char *buf)
+{
+	struct http_request *req = conn->req;
+	const char *errstr;
+	char *cp = buf, *end;
+	size_t len = strlen(buf);
+	long long first, last;
+
+	if (len == 0)
+		return http_headers_done(conn);
 
-		/* Look for some headers */
-		cp = buf;
 #define CONTENTLEN "Content-Length: "
-		if (strncasecmp(cp, CONTENTLEN, sizeof(CONTENTLEN) - 1) == 0) {
-			size_t s;
-			cp += sizeof(CONTENTLEN) - 1;
-			if ((s = strcspn(cp, " \t")))
-				*(cp+s) = 0;
-			filesize = strtonum(cp, 0, LLONG_MAX, &errstr);
-			if (errstr != NULL)
-				goto improper;
+	if (strncasecmp(cp, CONTENTLEN, sizeof(CONTENTLEN) - 1) == 0) {
+		cp += sizeof(CONTENTLEN) - 1;
+		cp[strcspn(cp, " \t")] = '\0';
+		conn->iosz = strtonum(cp, 0, LLONG_MAX, &errstr);
+		if (errstr != NULL) {
+			warnx("Improper response from %s", conn->host);
+			return FAILED;
+		}
 #define LOCATION "Location: "
-		} else if (isredirect &&
-		    strncasecmp(cp, LOCATION, sizeof(LOCATION) - 1) == 0) {
-			cp += sizeof(LOCATION) - 1;
-			/*
-			 * If there is a colon before the first slash, this URI
-			 * is not relative. RFC 3986 4.2
-			 */
-			if (cp[strcspn(cp, ":/")] != ':') {
-				fatalx("Relative redirect not supported");
-				/* XXX doesn't handle protocol-relative URIs */
-				if (*cp == '/') {
-					locbase = NULL;
-					cp++;
-				} else {
-					locbase = strdup(path);
-					if (locbase == NULL)
-						fatalx("Can't allocate memory"
-						    " for location base");
-					loctail = strchr(locbase, '#');
-					if (loctail != NULL)
-						*loctail = '\0';
-					loctail = strchr(locbase, '?');
-					if (loctail != NULL)
-						*loctail = '\0';
-					loctail = strrchr(locbase, '/');
-					if (loctail == NULL) {
-						free(locbase);
-						locbase = NULL;
-					} else
-						loctail[1] = '\0';
-				}
-				/* Contruct URL from relative redirect */
-				if (asprintf(&redirurl, "%s%s%s%s/%s%s",
-				    scheme, full_host,
-				    portnum ? ":" : "",
-				    portnum ? portnum : "",
-				    locbase ? locbase : "",
-				    cp) == -1)
-					fatalx("Cannot build "
-					    "redirect URL");
-				free(locbase);
-			} else
-				redirurl = xstrdup(cp);
-			loctail = strchr(redirurl, '#');
-			if (loctail != NULL)
-				*loctail = '\0';
-			log_info("Redirected to %s\n", redirurl);
-			ftp_close(&fin, &tls, &fd);
-			rval = url_get(redirurl, proxyenv, data, header_data,
-			    modified_since);
-			free(redirurl);
-			goto cleanup_url_get;
+	} else if (http_isredirect(conn->status) &&
+	    strncasecmp(cp, LOCATION, sizeof(LOCATION) - 1) == 0) {
+		cp += sizeof(LOCATION) - 1;
+		free(conn->redirect);
+		conn->redirect = xstrdup(cp);
 #define RETRYAFTER "Retry-After: "
-		} else if (isunavail &&
-		    strncasecmp(cp, RETRYAFTER, sizeof(RETRYAFTER) - 1) == 0) {
-			size_t s;
-			cp += sizeof(RETRYAFTER) - 1;
-			if ((s = strcspn(cp, " \t")))
-				cp[s] = '\0';
-			retryafter = strtonum(cp, 0, 0, &errstr);
-			if (errstr != NULL)
-				retryafter = -1;
+	} else if (conn->status == 503 &&
+	    strncasecmp(cp, RETRYAFTER, sizeof(RETRYAFTER) - 1) == 0) {
+		cp += sizeof(RETRYAFTER) - 1;
+		cp[strcspn(cp, " \t")] = '\0';
+		conn->retryafter = strtonum(cp, 0, 0, &errstr);
+		if (errstr != NULL)
+			conn->retryafter = -1;
 #define TRANSFER_ENCODING "Transfer-Encoding: "
-		} else if (strncasecmp(cp, TRANSFER_ENCODING,
-			    sizeof(TRANSFER_ENCODING) - 1) == 0) {
-			cp += sizeof(TRANSFER_ENCODING) - 1;
-			cp[strcspn(cp, " \t")] = '\0';
-			if (strcasecmp(cp, "chunked") == 0)
-				chunked = 1;
+	} else if (strncasecmp(cp, TRANSFER_ENCODING,
+	    sizeof(TRANSFER_ENCODING) - 1) == 0) {
+		cp += sizeof(TRANSFER_ENCODING) - 1;
+		cp[strcspn(cp, " \t")] = '\0';
+		if (strcasecmp(cp, "chunked") == 0)
+			conn->chunked = 1;
+#define CONTENT_RANGE "Content-Range: bytes "
+	} else if (conn->status == 206 &&
+	    strncasecmp(cp, CONTENT_RANGE, sizeof(CONTENT_RANGE) - 1) == 0) {
+		cp += sizeof(CONTENT_RANGE) - 1;
+		errno = 0;
+		first = strtoll(cp, &end, 10);
+		if (first != req->data->range_start || errno != 0 ||
+		    *end != '-') {
+			warnx("%s: unexpected Content-Range %s", req->uri, cp);
+			return FAILED;
 		}
-		header_callback(buf, 1, len, header_data);
-		free(buf);
+		last = strtoll(end + 1, &end, 10);
+		if (first == 0 && *end == '/' &&
+		    strtoll(end + 1, NULL, 10) == last + 1 && errno == 0)
+			req->whole = 1;
+#define CONTENT_ENCODING "Content-Encoding: "
+	} else if (strncasecmp(cp, CONTENT_ENCODING,
+	    sizeof(CONTENT_ENCODING) - 1) == 0) {
+		cp += sizeof(CONTENT_ENCODING) - 1;
+		cp[strcspn(cp, " \t")] = '\0';
+		if (http_zinit(conn, cp) == -1)
+			return FAILED;
+		req->compressed = conn->zs != NULL;
+#define CONNECTION "Connection: "
+	} else if (strncasecmp(cp, CONNECTION,
+	    sizeof(CONNECTION) - 1) == 0) {
+		cp += sizeof(CONNECTION) - 1;
+		cp[strcspn(cp, " \t")] = '\0';
+		if (strcasecmp(cp, "close") == 0)
+			conn->keepalive = 0;
 	}
+	header_callback(buf, 1, len, &req->header_data);
+	return DONE;
+}
 
-	/* Content-Length should be ignored for Transfer-Encoding: chunked */
-	if (chunked)
-		filesize = -1;
+static enum res
+http_parse_proxy_response(struct http_connection *conn, char *buf)
+{
+	char gerror[200], *cp;
+
+	if (conn->state == STATE_PROXY_STATUS) {
+		cp = strchr(buf, ' ');
+		if (strncmp(buf, "HTTP/1.", 7) != 0 || cp == NULL ||
+		    strncmp(cp + 1, "200", 3) != 0) {
+			strnvis(gerror, buf, sizeof gerror, VIS_SAFE);
+			warnx("%s: CONNECT failed: %s", conn->proxyhost,
+			    gerror);
+			return FAILED;
+		}
+		conn->state = STATE_PROXY_RESPONSE;
+		return DONE;
+	}
+	if (*buf != '\0')
+		return DONE;
+	if (conn->bufpos != conn->bufoff) {
+		warnx("%s: unexpected data after CONNECT", conn->proxyhost);
+		return FAILED;
+	}
+	return http_tls_connect(conn);
+}
 
-	if (isunavail) {
-		if (retried || retryafter != 0)
-			warnx("Error retrieving %s: 503 Service Unavailable",
-			    origline);
-		else {
-			log_info("Retrying %s\n", origline);
-			retried = 1;
-			ftp_close(&fin, &tls, &fd);
-			rval = url_get(origline, proxyenv, data, header_data,
-			    modified_since);
+/*
+ * Pass len bytes of the body on, left more are to follow (-1 if that is
+ * not known). Once the parser has all it needs, what is left of a short
+ * body is read to keep the connection, else the request is finished
+ * early and the connection goes to STATE_CLOSE.
+ */
+static enum res
+http_body(struct http_connection *conn, char *buf, size_t len, off_t left)
+{
+	if (http_deliver(conn, buf, len) == -1) {
+		warnx("parse error");
+		return FAILED;
+	}
+	if (!conn->req->data->stop || conn->discard)
+		return DONE;
+
+	log_debug("%s: rest of the document not needed", conn->req->uri);
+	http_zfree(conn);
+	if (left == -1 || left > HTTP_BUF_SIZE) {
+		http_req_done(conn->req, conn->status);
+		conn->req = NULL;
+		conn->state = STATE_CLOSE;
+		return DONE;
+	}
+	conn->discard = 1;
+	return DONE;
+}
+
+/*
+ * Read body bytes straight into the memory of the parser, saving their
+ * copy from the receive buffer.
+ */
+static enum res
+http_read_body(struct http_connection *conn)
+{
+	size_t n = HTTP_BUF_SIZE;
+	enum res res;
+	ssize_t s;
+	char *buf;
+
+	if (conn->iosz != -1 && conn->iosz < (off_t)n)
+		n = conn->iosz;
+	if ((buf = xml_buffer(conn->req->data, n)) == NULL)
+		return http_read(conn);
+	if ((res = http_recv(conn, buf, n, &s)) != DONE || s == 0)
+		return res;
+	if (http_body(conn, buf, s,
+	    conn->iosz == -1 ? -1 : conn->iosz - s) == FAILED)
+		return FAILED;
+	if (conn->state != STATE_CLOSE && conn->iosz != -1)
+		conn->iosz -= s;
+	return DONE;
+}
+
+/*
+ * Hand the body bytes in the receive buffer to the document consumer.
+ */
+static enum res
+http_data(struct http_connection *conn)
+{
+	size_t n;
+
+	if (conn->bufpos > conn->bufoff && conn->iosz != 0) {
+		n = conn->bufpos - conn->bufoff;
+		if (conn->iosz != -1 && (off_t)n > conn->iosz)
+			n = conn->iosz;
+		if (http_body(conn, conn->buf + conn->bufoff, n,
+		    conn->iosz == -1 ? -1 : conn->iosz - (off_t)n) == FAILED)
+			return FAILED;
+		if (conn->state == STATE_CLOSE)
+			return DONE;
+		conn->bufoff += n;
+		if (conn->iosz != -1)
+			conn->iosz -= n;
+	}
+	if (conn->iosz == 0 || conn->eof)
+		return http_done(conn);
+	if (conn->zs == NULL && !conn->discard)
+		return http_read_body(conn);
+	return http_read(conn);
+}
+
+/*
+ * Decode as much of a chunked body as the receive buffer holds. The
+ * payload of small chunks is moved together in place over the framing
+ * already parsed, so the consumer gets few large spans no matter how
+ * small the chunks are. Larger payload is passed on where it is.
+ */
+static enum res
+http_chunked(struct http_connection *conn)
+{
+	unsigned long chunksize;
+	size_t start = conn->bufoff, wpos = conn->bufoff, n;
+	char *line, *end;
+	int last = 0;
+
+	while (!last) {
+		if (conn->state == STATE_RESPONSE_DATA) {
+			n = conn->bufpos - conn->bufoff;
+			if ((off_t)n > conn->iosz)
+				n = conn->iosz;
+			if (n == 0)
+				break;
+			if (wpos != conn->bufoff && n > CHUNK_MOVE_MAX) {
+				if (wpos > start && http_body(conn,
+				    conn->buf + start, wpos - start,
+				    -1) == FAILED)
+					return FAILED;
+				if (conn->state == STATE_CLOSE)
+					return DONE;
+				start = wpos = conn->bufoff;
+			} else if (wpos != conn->bufoff)
+				memmove(conn->buf + wpos,
+				    conn->buf + conn->bufoff, n);
+			wpos += n;
+			conn->bufoff += n;
+			if ((conn->iosz -= n) == 0)
+				conn->state = STATE_RESPONSE_CHUNKED_CRLF;
+			continue;
+		}
+		if ((line = http_get_line(conn)) == NULL)
+			break;
+		switch (conn->state) {
+		case STATE_RESPONSE_CHUNKED_HEADER:
+			/* strip any optional chunk extension */
+			line[strcspn(line, "; \t")] = '\0';
+			errno = 0;
+			chunksize = strtoul(line, &end, 16);
+			if (errno || line[0] == '\0' || *end != '\0' ||
+			    chunksize > INT_MAX) {
+				warnx("Invalid chunk size '%s'", line);
+				return FAILED;
+			}
+			conn->iosz = chunksize;
+			conn->state = chunksize == 0 ?
+			    STATE_RESPONSE_CHUNKED_TRAILER :
+			    STATE_RESPONSE_DATA;
+			break;
+		case STATE_RESPONSE_CHUNKED_CRLF:
+			if (*line != '\0') {
+				warnx("Invalid chunked encoding");
+				return FAILED;
+			}
+			conn->state = STATE_RESPONSE_CHUNKED_HEADER;
+			break;
+		default:
+			/* the optional trailer ends with an empty line */
+			last = *line == '\0';
+			break;
 		}
-		goto cleanup_url_get;
 	}
 
-	/* Open the output file.  */
-	out = fileno(stdout);
+	if (wpos > start) {
+		if (http_body(conn, conn->buf + start, wpos - start,
+		    -1) == FAILED)
+			return FAILED;
+		if (conn->state == STATE_CLOSE)
+			return DONE;
+	}
+	if (last)
+		return http_done(conn);
+	return http_read(conn);
+}
+
+/*
+ * Advance the state machine of conn by one step.
+ */
+static enum res
+http_step(struct http_connection *conn)
+{
+	char *line;
+
+	switch (conn->state) {
+	case STATE_RESOLVE:
+		return http_resolve(conn);
+	case STATE_CONNECT:
+		return http_finish_connect(conn);
+	case STATE_TLSCONNECT:
+		return http_tls_handshake(conn);
+	case STATE_PROXY_REQUEST:
+	case STATE_REQUEST:
+		return http_write(conn);
+	case STATE_RESPONSE_DATA:
+	case STATE_RESPONSE_CHUNKED_HEADER:
+	case STATE_RESPONSE_CHUNKED_CRLF:
+	case STATE_RESPONSE_CHUNKED_TRAILER:
+		return conn->chunked ? http_chunked(conn) : http_data(conn);
+	case STATE_IDLE:
+	case STATE_CLOSE:
+		return DONE;
+	default:
+		break;
+	}
 
-	free(buf);
-	if ((buf = malloc(buflen)) == NULL)
-		fatal("Can't allocate memory for transfer buffer");
+	if ((line = http_get_line(conn)) == NULL)
+		return http_read(conn);
+	switch (conn->state) {
+	case STATE_PROXY_STATUS:
+	case STATE_PROXY_RESPONSE:
+		return http_parse_proxy_response(conn, line);
+	case STATE_RESPONSE_STATUS:
+		return http_parse_status(conn, line);
+	default:
+		return http_parse_header(conn, line);
+	}
+}
 
-	/* Trap signals */
-	oldintr = NULL;
-	oldinti = NULL;
-	if (setjmp(httpabort)) {
-		if (oldintr)
-			(void)signal(SIGINT, oldintr);
-		if (oldinti)
-			(void)signal(SIGINFO, oldinti);
-		goto cleanup_url_get;
+/*
+ * Start the requests still queued on conn over again elsewhere. None of
+ * them got any part of its response yet.
+ */
+static void
+http_requeue(struct http_connection *conn)
+{
+	struct http_request *req;
+
+	while ((req = TAILQ_FIRST(&conn->queue)) != NULL) {
+		TAILQ_REMOVE(&conn->queue, req, entry);
+		conn->nqueue--;
+		req->conn = NULL;
+		req->sent = 0;
+		req->deadline = 0;
+		http_req_start(req);
 	}
-	oldintr = signal(SIGINT, aborthttp);
+}
+
+static void
+http_failed(struct http_connection *conn)
+{
+	struct http_request *req = conn->req;
+
+	TAILQ_REMOVE(&active, conn, entry);
+	active_gen++;
+	if (req != NULL) {
+		if (http_stale(conn)) {
+			log_debug("stale connection to %s", conn->key);
+			conn->req = NULL;
+			TAILQ_INSERT_HEAD(&conn->queue, req, entry);
+			conn->nqueue++;
+		} else
+			http_req_done(req, -1);
+	}
+	http_requeue(conn);
+	http_free(conn);
+}
 
-	bytes = 0;
+/*
+ * Run conn until it has to wait for the network.
+ */
+static void
+http_process(struct http_connection *conn)
+{
+	enum res res;
+
+	do {
+		res = http_step(conn);
+	} while (res == DONE && conn->state != STATE_IDLE &&
+	    conn->state != STATE_CLOSE);
+	conn->revents = 0;
+
+	switch (res) {
+	case WANT_POLLIN:
+		conn->events = POLLIN;
+		return;
+	case WANT_POLLOUT:
+		conn->events = POLLOUT;
+		return;
+	case FAILED:
+		http_failed(conn);
+		return;
+	case DONE:
+		break;
+	}
 
-	/* Finally, suck down the file. */
-	if (chunked) {
-		error = save_chunked(fin, tls, out, buf, buflen, &bytes, data);
-		signal(SIGINT, oldintr);
-		signal(SIGINFO, oldinti);
-		if (error == -1)
-			goto cleanup_url_get;
+	TAILQ_REMOVE(&active, conn, entry);
+	active_gen++;
+	if (conn->state == STATE_IDLE) {
+		log_debug("keeping connection to %s", conn->key);
+		conn->deadline = conn->timeout = 0;
+		TAILQ_INSERT_TAIL(&idle, conn, entry);
 	} else {
-		while ((len = fread(buf, 1, buflen, fin)) > 0) {
-			bytes += len;
-			if (write_callback(buf, 1, len, data) == 0) {
-				warnx("parse error");
-				goto cleanup_url_get;
+		http_requeue(conn);
+		http_free(conn);
+	}
+}
+
+/*
+ * Check if req can be pipelined behind the requests of the active
+ * connection conn.
+ */
+static int
+http_can_queue(struct http_connection *conn, struct http_request *req)
+{
+	if (!req->data->opts->pipeline || req->data->bulk ||
+	    conn->closing || conn->state == STATE_CLOSE ||
+	    conn->nqueue >= PIPELINE_MAX)
+		return 0;
+	/* nothing waits for a snapshot to come down the line */
+	if (conn->req != NULL && conn->req->data->bulk)
+		return 0;
+	/* the server will close after the current response */
+	if (conn->state > STATE_RESPONSE_STATUS && !conn->keepalive)
+		return 0;
+	return strcmp(conn->key, req->key) == 0;
+}
+
+/*
+ * Put req on an idle connection to the same origin or open a new one.
+ * With pipelining it may also queue up on an active connection.
+ */
+static void
+http_req_start(struct http_request *req)
+{
+	struct http_connection *conn;
+
+	TAILQ_FOREACH(conn, &active, entry)
+		if (http_can_queue(conn, req))
+			break;
+	if (conn != NULL) {
+		log_debug("pipelining on connection to %s", conn->key);
+		TAILQ_INSERT_TAIL(&conn->queue, req, entry);
+		conn->nqueue++;
+		req->conn = conn;
+		/* if the others already went out, send this one right away */
+		if (conn->state == STATE_RESPONSE_STATUS &&
+		    conn->bufpos == conn->bufoff) {
+			http_request_prepare(conn);
+			http_process(conn);
+		}
+		return;
+	}
+	TAILQ_FOREACH(conn, &idle, entry)
+		if (strcmp(conn->key, req->key) == 0)
+			break;
+	if (conn != NULL) {
+		log_debug("reusing connection to %s", conn->key);
+		TAILQ_REMOVE(&idle, conn, entry);
+		conn->reused = 1;
+	} else if ((conn = http_new(req)) == NULL) {
+		http_req_done(req, -1);
+		return;
+	}
+	TAILQ_INSERT_TAIL(&active, conn, entry);
+	active_gen++;
+	conn->req = req;
+	req->conn = conn;
+	if (conn->reused)
+		http_request_prepare(conn);
+	http_process(conn);
+}
+
+/*
+ * The earliest time conn has to be looked at without network events.
+ */
+static long long
+http_wakeup(struct http_connection *conn)
+{
+	long long wake = conn->deadline;
+
+	if (conn->timeout != 0 && (wake == 0 || conn->timeout < wake))
+		wake = conn->timeout;
+	if (conn->req != NULL && conn->req->deadline != 0 &&
+	    (wake == 0 || conn->req->deadline < wake))
+		wake = conn->req->deadline;
+	return wake;
+}
+
+/*
+ * Check if the current phase of conn stalled for too long or if the body
+ * of its response came in too slowly over the last TRANSFER_WINDOW. Data
+ * waiting on conn means we did not keep up, that does not count against
+ * the server.
+ */
+static int
+http_timedout(struct http_connection *conn, long long now)
+{
+	struct http_request *req = conn->req;
+	const char *phase;
+
+	if (req != NULL && req->deadline != 0 && now >= req->deadline) {
+		if (conn->revents == 0 &&
+		    req->window < TRANSFER_MIN_RATE * TRANSFER_WINDOW) {
+			warnx("%s: transfer too slow", req->uri);
+			return 1;
+		}
+		req->deadline = now + TRANSFER_WINDOW * 1000LL;
+		req->window = 0;
+	}
+	if (conn->revents != 0 || conn->timeout == 0 || now < conn->timeout)
+		return 0;
+	switch (conn->state) {
+	case STATE_REQUEST:
+	case STATE_RESPONSE_STATUS:
+		phase = "waiting for the response";
+		break;
+	case STATE_PROXY_REQUEST:
+	case STATE_PROXY_STATUS:
+	case STATE_PROXY_RESPONSE:
+	case STATE_TLSCONNECT:
+		phase = "handshake";
+		break;
+	default:
+		phase = "read";
+		break;
+	}
+	warnx("%s: %s timed out", conn->host, phase);
+	return 1;
+}
+
+/*
+ * Check if job can go on: it did not start yet or one of the documents
+ * it waits for is downloaded.
+ */
+static int
+http_job_ready(struct http_job *job)
+{
+	int j;
+
+	if (job->set == NULL)
+		return 1;
+	for (j = 0; j < job->n; j++)
+		if (job->set[j]->req->done)
+			return 1;
+	return 0;
+}
+
+/*
+ * Hand job_lock to a waiting job that can go on. With any set, a job
+ * that still waits will do as well, it keeps the transfers going.
+ * Returns 1 if a job was woken up.
+ */
+static int
+http_job_wakeup(int any)
+{
+	struct http_job *job;
+
+	TAILQ_FOREACH(job, &job_waiting, entry)
+		if (http_job_ready(job))
+			break;
+	if (job == NULL && any)
+		job = TAILQ_FIRST(&job_waiting);
+	if (job == NULL)
+		return 0;
+	TAILQ_REMOVE(&job_waiting, job, entry);
+	job->wake = 1;
+	pthread_cond_signal(&job->cond);
+	return 1;
+}
+
+/*
+ * Let other jobs run until one of them hands job_lock back.
+ */
+static void
+http_job_wait(struct xmldata **set, int n)
+{
+	struct http_job *job = job_current;
+
+	job->set = set;
+	job->n = n;
+	job->wake = 0;
+	TAILQ_INSERT_TAIL(&job_waiting, job, entry);
+	while (!job->wake)
+		pthread_cond_wait(&job->cond, &job_lock);
+	job_current = job;
+}
+
+/*
+ * Drive all connections until one of the n documents in set is
+ * downloaded and return its index.
+ */
+static int
+http_run(struct xmldata **set, int n)
+{
+	struct http_connection *conn, *nconn;
+	struct pollfd *pfds = NULL;
+	long long now, t, wake;
+	size_t npfds, i;
+	unsigned int gen;
+	int j, k, timeout;
+
+	for (;;) {
+		for (j = 0; j < n; j++)
+			if (set[j]->req->done) {
+				free(pfds);
+				return j;
 			}
+		/* another job got what it waited for, let it go on first */
+		if (job_current != NULL && http_job_wakeup(0)) {
+			http_job_wait(set, n);
+			continue;
+		}
+
+		npfds = 0;
+		TAILQ_FOREACH(conn, &active, entry)
+			npfds += conn->state == STATE_CONNECT ?
+			    conn->nattempts : 1;
+		if (npfds == 0)
+			fatalx("%s: no transfer in progress", __func__);
+		if ((pfds = reallocarray(pfds, npfds, sizeof(*pfds))) == NULL)
+			fatal("%s - reallocarray", __func__);
+
+		timeout = INFTIM;
+		now = getmonotime();
+		i = 0;
+		TAILQ_FOREACH(conn, &active, entry) {
+			if (conn->state == STATE_CONNECT) {
+				for (k = 0; k < conn->nattempts; k++, i++) {
+					pfds[i].fd = conn->attempts[k].fd;
+					pfds[i].events = POLLOUT;
+					pfds[i].revents = 0;
+				}
+			} else {
+				pfds[i].fd = conn->pfd;
+				pfds[i].events = conn->events;
+				pfds[i++].revents = 0;
+			}
+			if ((wake = http_wakeup(conn)) != 0) {
+				t = wake > now ? wake - now : 0;
+				if (timeout == INFTIM || t < timeout)
+					timeout = t;
+			}
+		}
+
+		if (poll(pfds, npfds, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			fatal("%s - poll", __func__);
 		}
-		save_errno = errno;
-		signal(SIGINT, oldintr);
-		signal(SIGINFO, oldinti);
-		if (len == 0 && ferror(fin)) {
-			errno = save_errno;
-			warnx("Reading from socket: %s", sockerror(tls));
-			goto cleanup_url_get;
+
+		/*
+		 * Processing one connection may start, finish or free others,
+		 * so the pass ends as soon as active changes. Whatever it did
+		 * not get to is polled again right away.
+		 */
+		now = getmonotime();
+		gen = active_gen;
+		i = 0;
+		TAILQ_FOREACH_SAFE(conn, &active, entry, nconn) {
+			if (conn->state == STATE_CONNECT) {
+				conn->revents = 0;
+				for (k = 0; k < conn->nattempts; k++, i++) {
+					conn->attempts[k].revents =
+					    pfds[i].revents;
+					conn->revents |= pfds[i].revents;
+				}
+			} else
+				conn->revents = pfds[i++].revents;
+			if (http_timedout(conn, now))
+				http_failed(conn);
+			else if (conn->revents != 0 ||
+			    (conn->deadline != 0 && now >= conn->deadline))
+				http_process(conn);
+			if (active_gen != gen)
+				break;
 		}
 	}
-	if (filesize != -1 && len == 0 && bytes != filesize) {
-		log_info("Read short file.\n");
-		goto cleanup_url_get;
+}
+
+static void *
+http_job_main(void *arg)
+{
+	struct http_job *job = arg;
+
+	pthread_mutex_lock(&job_lock);
+	while (!job->wake)
+		pthread_cond_wait(&job->cond, &job_lock);
+	job_current = job;
+	job->fn(job->arg);
+	job_current = NULL;
+	/* someone has to go on driving the transfers */
+	http_job_wakeup(1);
+	pthread_mutex_unlock(&job_lock);
+	return NULL;
+}
+
+/*
+ * Run fn(arg) in n jobs at once and wait for all of them to return. Only
+ * one job runs at a time, the others wait for their transfers.
+ */
+void
+http_jobs(void (*fn)(void *), void *arg, int n)
+{
+	struct http_job *jobs;
+	int i, error;
+
+	if ((jobs = calloc(n, sizeof(*jobs))) == NULL)
+		fatal("%s - calloc", __func__);
+	pthread_mutex_lock(&job_lock);
+	for (i = 0; i < n; i++) {
+		jobs[i].fn = fn;
+		jobs[i].arg = arg;
+		pthread_cond_init(&jobs[i].cond, NULL);
+		TAILQ_INSERT_TAIL(&job_waiting, &jobs[i], entry);
+		if ((error = pthread_create(&jobs[i].thread, NULL,
+		    http_job_main, &jobs[i])) != 0)
+			fatalx("%s - pthread_create: %s", __func__,
+			    strerror(error));
 	}
+	http_job_wakeup(1);
+	pthread_mutex_unlock(&job_lock);
+	for (i = 0; i < n; i++) {
+		pthread_join(jobs[i].thread, NULL);
+		pthread_cond_destroy(&jobs[i].cond);
+	}
+	free(jobs);
+}
 
-	rval = status;
-	goto cleanup_url_get;
+/*
+ * Read the CA bundle. This has to happen before the filesystem is
+ * restricted with unveil(2), the TLS configurations are made from it.
+ */
+void
+http_init(void)
+{
+	const char *ca_file = tls_default_ca_cert_file();
 
-improper:
-	warnx("Improper response from %s", host);
+	if ((tls_ca_mem = tls_load_file(ca_file, &tls_ca_size, NULL)) == NULL)
+		fatal("%s: tls_load_file", ca_file);
+}
 
-cleanup_url_get:
-	free(full_host);
-	free(sslhost);
-	ftp_close(&fin, &tls, &fd);
-	if (out >= 0 && out != fileno(stdout))
-		close(out);
-	free(buf);
-	free(proxyhost);
-	free(proxyurl);
-	free(newline);
-	free(credentials);
-	free(proxy_credentials);
-	return (rval);
+void
+http_conn_pool_free(void)
+{
+	struct http_connection *conn;
+	struct http_endpoint *ep;
+	struct http_dns *dns;
+	struct tls_host *th;
+
+	while ((conn = TAILQ_FIRST(&idle)) != NULL) {
+		TAILQ_REMOVE(&idle, conn, entry);
+		http_free(conn);
+	}
+	while ((dns = TAILQ_FIRST(&dns_cache)) != NULL) {
+		TAILQ_REMOVE(&dns_cache, dns, entry);
+		free(dns->target);
+		free(dns->addrs);
+		free(dns);
+	}
+	while ((ep = TAILQ_FIRST(&endpoints)) != NULL)
+		http_endpoint_free(ep);
+	while ((th = TAILQ_FIRST(&tls_hosts)) != NULL) {
+		TAILQ_REMOVE(&tls_hosts, th, entry);
+		tls_config_free(th->config);
+		if (th->fd != -1)
+			close(th->fd);
+		free(th->key);
+		free(th);
+	}
 }
 
-long
-fetch_xml_uri(struct xmldata *data) {
-	char *modified_since = NULL;
+/*
+ * Finish the parse and the hash of a document. Checks are only done if
+ * the whole document was received (complete), else only cleanup happens.
+ */
+static int
+finish_xml_data(struct xmldata *data, int complete)
+{
+	unsigned char obuff[SHA256_DIGEST_LENGTH];
+	int ret = 0;
+
+	/* expat may still hold back the tail of the document */
+	if (complete && data->parser != NULL && !data->stop &&
+	    xml_parse(data, NULL, 0, 1) == -1) {
+		log_warnx("%s: parse error at end of document", data->uri);
+		ret = -1;
+	}
+	if (data->hash) {
+		SHA256_Final(obuff, &data->ctx);
+		if (complete && ret == 0 && hash_check(obuff, data->hash) == -1)
+			ret = -1;
+	}
+	return ret;
+}
+
+/*
+ * Queue the download of data->uri. It makes progress while any transfer
+ * is waited for with fetch_xml_wait() or fetch_xml_wait_any().
+ */
+void
+fetch_xml_start(struct xmldata *data)
+{
+	struct http_request *req;
 	time_t current_time;
 	struct tm *gmt_time;
-	unsigned char obuff[SHA256_DIGEST_LENGTH];
-	struct header_data header_data;
-	long ret = 200;
 
-	redirect_loop = 0;
-	retried = 0;
+	if ((req = calloc(1, sizeof(*req))) == NULL)
+		fatal("%s - calloc", __func__);
+	req->data = data;
+	req->uri = xstrdup(data->uri);
+	data->req = req;
+
 	if (data->hash)
 		SHA256_Init(&data->ctx);
 	/* abuse that we never use modified since if we have a hash */
 	else {
-		if (strlen(data->modified_since) != 0) {
-			if ((asprintf(&modified_since, "%s: %s",
-			    IF_MODIFIED_SINCE, data->modified_since)) == -1)
-				fatal("%s - asprintf", __func__);
-		}
+		if (asprintf(&req->conditional, "%s%s%s%s%s%s",
+		    data->modified_since[0] != '\0' ?
+		    IF_MODIFIED_SINCE ": " : "", data->modified_since,
+		    data->modified_since[0] != '\0' ? "\r\n" : "",
+		    data->etag[0] != '\0' ? IF_NONE_MATCH ": " : "",
+		    data->etag, data->etag[0] != '\0' ? "\r\n" : "") == -1)
+			fatal("%s - asprintf", __func__);
 		/* get current gmt time to save for next time */
 		if ((current_time = time(NULL)) == (time_t)-1)
 			fatal("%s - time", __func__);
 		if ((gmt_time = gmtime(&current_time)) == NULL)
 			fatal("%s - gmtime", __func__);
 		/* XXXNF what to do about localisation */
-		if (strftime(data->modified_since, TIME_LEN, TIME_FORMAT,
+		if (strftime(req->date, TIME_LEN, TIME_FORMAT,
 		    gmt_time) != TIME_LEN - 1)
 			fatal("%s - strftime", __func__);
 	}
-	if ((ret = url_get(data->uri, data->opts->httpproxy, data,
-	    &header_data, modified_since)) == -1) {
-		free(modified_since);
-		warnx("url_get failed");
+
+	if (data->range_end > 0) {
+		if (asprintf(&req->range, "Range: bytes=%lld-%lld\r\n",
+		    (long long)data->range_start,
+		    (long long)data->range_end) == -1)
+			fatal("%s - asprintf", __func__);
+	} else if (data->range_start > 0) {
+		if (asprintf(&req->range, "Range: bytes=%lld-\r\n%s%s%s",
+		    (long long)data->range_start,
+		    data->validator[0] != '\0' ? "If-Range: " : "",
+		    data->validator,
+		    data->validator[0] != '\0' ? "\r\n" : "") == -1)
+			fatal("%s - asprintf", __func__);
 	}
-	free(modified_since);
-	if (data->hash) {
-		SHA256_Final(obuff, &data->ctx);
-		if (ret == 200 && hash_check(obuff, data->hash) == -1)
-			ret = -1;
+
+	if (http_req_target(req) == -1) {
+		http_req_done(req, -1);
+		return;
+	}
+	http_req_start(req);
+}
+
+/*
+ * Run the transfers until one of the n documents in set is downloaded,
+ * return its index. Its result is collected with fetch_xml_wait().
+ */
+int
+fetch_xml_wait_any(struct xmldata **set, int n)
+{
+	return http_run(set, n);
+}
+
+/*
+ * Wait for the download of data to finish. Returns the HTTP status or -1
+ * if the transfer, the parse or the hash check failed.
+ */
+long
+fetch_xml_wait(struct xmldata *data)
+{
+	struct http_request *req = data->req;
+	long ret;
+
+	if (!req->done)
+		http_run(&data, 1);
+	if ((ret = req->status) == -1)
+		warnx("fetching %s failed", data->uri);
+	if (finish_xml_data(data, ret == 200) == -1)
+		ret = -1;
+	/*
+	 * Both validators describe the whole document, so they only change
+	 * together and only with a response that has all of it. After a
+	 * 304 the ones sent still hold.
+	 */
+	if (ret == 200 || (ret == 206 && req->whole)) {
+		if (strlen(req->header_data.last_modified) > 0)
+			strcpy(data->modified_since,
+			    req->header_data.last_modified);
+		else if (strlen(req->header_data.date) > 0)
+			strcpy(data->modified_since, req->header_data.date);
+		else
+			strcpy(data->modified_since, req->date);
+		strlcpy(data->etag, req->header_data.etag, VALIDATOR_LEN);
 	}
-	if (strlen(header_data.last_modified) > 0)
-		strcpy(data->modified_since, header_data.last_modified);
-	else if (strlen(header_data.date) > 0)
-		strcpy(data->modified_since, header_data.date);
+	/*
+	 * A strong ETag of the uncompressed document is the best validator
+	 * for If-Range, otherwise fall back to the modification time.
+	 */
+	if (req->header_data.etag[0] == '"' && !req->compressed)
+		strlcpy(data->validator, req->header_data.etag,
+		    VALIDATOR_LEN);
+	else if (strlen(req->header_data.last_modified) > 0)
+		strlcpy(data->validator, req->header_data.last_modified,
+		    VALIDATOR_LEN);
+	http_req_free(req);
+	data->req = NULL;
 	return ret;
 }
 
+/*
+ * Abort the download of data.
+ */
+void
+fetch_xml_cancel(struct xmldata *data)
+{
+	struct http_request *req = data->req;
+	struct http_connection *conn;
+
+	if ((conn = req->conn) != NULL && conn->req != req) {
+		/* still queued, a sent request spoils the connection */
+		TAILQ_REMOVE(&conn->queue, req, entry);
+		conn->nqueue--;
+		if (req->sent)
+			conn->closing = 1;
+	} else if (conn != NULL) {
+		TAILQ_REMOVE(&active, conn, entry);
+		active_gen++;
+		conn->req = NULL;
+		http_requeue(conn);
+		http_free(conn);
+	}
+	finish_xml_data(data, 0);
+	http_req_free(req);
+	data->req = NULL;
+}
+
+long
+fetch_xml_uri(struct xmldata *data) {
+	fetch_xml_start(data);
+	return fetch_xml_wait(data);
+}
+
+/*
+ * Feed a document spooled in fd through the parser.
+ */
+int
+parse_xml_file(struct xmldata *data, int fd)
+{
+	const size_t buflen = 128 * 1024;
+	char *buf, *own = NULL;
+	ssize_t len;
+
+	if (data->hash)
+		SHA256_Init(&data->ctx);
+	for (;;) {
+		/* read straight into expat if it parses the document */
+		if ((buf = xml_buffer(data, buflen)) == NULL &&
+		    (buf = own) == NULL &&
+		    (buf = own = malloc(buflen)) == NULL)
+			fatal("%s - malloc", __func__);
+		if ((len = read(fd, buf, buflen)) <= 0)
+			break;
+		if (write_callback(buf, 1, len, data) == 0)
+			break;
+	}
+	if (len == -1)
+		log_warn("%s: read", data->uri);
+	free(own);
+	/* stopping early means the parse failed */
+	if (finish_xml_data(data, len == 0) == -1 || len != 0)
+		return -1;
+	return 0;
+}
@@ -73,8 +73,13 @@ mkpath_at(int fd, const char *dir)
 	return 0;
 }
 
+/*
+ * Delete everything below dir and the directories from min_del_level
+ * on. With keep_dotfiles the dot-files at the top of dir are left alone,
+ * rrdp keeps its state, endpoints and TLS sessions there.
+ */
 int
-rm_dir(char *dir, int min_del_level)
+rm_dir(char *dir, int min_del_level, int keep_dotfiles)
 {
 	FTSENT *node;
 	FTS *tree;
@@ -88,6 +93,12 @@ rm_dir(char *dir, int min_del_level)
 	log_debuginfo("deleting %s", dir);
 
 	while ((node = fts_read(tree))) {
+		if (keep_dotfiles && node->fts_level == 1 &&
+		    node->fts_name[0] == '.') {
+			if (node->fts_info == FTS_D)
+				fts_set(tree, node, FTS_SKIP);
+			continue;
+		}
 		/* clear "from" directories as leave them */
 		if (node->fts_info & FTS_D)
 			continue;
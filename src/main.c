@@ -20,6 +20,8 @@
 #include <syslog.h>
 #include <err.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
 #include <sys/stat.h>
 
 #include "log.h"
@@ -27,13 +29,21 @@
 
 #define HTTP_PROXY      "http_proxy"
 
+/* deltas asked for their size to estimate the size of all */
+#define PLAN_SAMPLES	4
+/* bytes/s assumed until a run measured the real thing */
+#define PLAN_THROUGHPUT	(1024 * 1024)
+
 static int
 rm_working_dir(struct opts *opts, int min_del_level)
 {
 	int ret;
-	if (min_del_level == 0 && close(opts->working_dir))
-		fatal("%s - close", __func__);
-	if ((ret = rm_dir(opts->basedir_working, min_del_level)) != 0) {
+	if (min_del_level == 0) {
+		if (close(opts->working_dir))
+			fatal("%s - close", __func__);
+		opts->working_dir = -1;
+	}
+	if ((ret = rm_dir(opts->basedir_working, min_del_level, 0)) != 0) {
 		log_warnx("%s - failed to remove working dir", __func__);
 		ret = 1;
 	}
@@ -45,21 +55,48 @@ rm_primary_dir(struct opts *opts)
 {
 	/*
 	 * Don't delete the primary dir itself (use flag).
-	 * It has an open fd we will use.
+	 * It has an open fd we will use. The dot-files are not part of
+	 * the repository, the TLS session files are open as well. Only the
+	 * state goes, it describes what was deleted.
 	 */
-	return rm_dir(opts->basedir_primary, 1);
+	if (unlinkat(opts->primary_dir, STATE_FILENAME, 0) == -1 &&
+	    errno != ENOENT)
+		log_warn("%s - unlink %s", __func__, STATE_FILENAME);
+	return rm_dir(opts->basedir_primary, 1, 1);
 }
 
 static struct xmldata*
 fetch_notification_xml(char* uri, struct opts *opts)
 {
 	struct xmldata *xml_data = new_notification_xml_data(uri, opts);
+	struct notification_xml *nxml = xml_data->xml_data;
 	long res;
-	res = fetch_xml_uri(xml_data);
-	if (res != 200 && res != 304)
-		fatalx("%s", __func__);
 
-	struct notification_xml *nxml = xml_data->xml_data;
+	if (opts->probe && nxml->current_session_id != NULL) {
+		/*
+		 * The session and serial come first, the head of the file
+		 * shows if anything changed and often has the new deltas
+		 * too. A server ignoring the range sends all of it, which
+		 * is just as good.
+		 */
+		xml_data->range_end = NOTIFICATION_PROBE_SIZE - 1;
+		res = fetch_xml_uri(xml_data);
+		xml_data->range_end = 0;
+		if (res != 200 && res != 304 &&
+		    (res != 206 || !xml_data->stop)) {
+			log_debuginfo("probe inconclusive, fetching all");
+			free_xml_data(xml_data);
+			xml_data = new_notification_xml_data(uri, opts);
+			nxml = xml_data->xml_data;
+			res = fetch_xml_uri(xml_data);
+		}
+	} else
+		res = fetch_xml_uri(xml_data);
+	if (res != 200 && res != 206 && res != 304) {
+		log_warnx("%s: failed to fetch notification", uri);
+		free_xml_data(xml_data);
+		return NULL;
+	}
 
 	if (!nxml)
 		fatalx("no notification_xml available");
@@ -74,21 +111,99 @@ fetch_notification_xml(char* uri, struct opts *opts)
 	return xml_data;
 }
 
+/*
+ * Estimate how long catching up takes with the deltas and with the
+ * snapshot and switch to the snapshot if that is quicker. The sizes come
+ * from HEAD requests. They go one after the other over the connection
+ * the notification came in on, so their time is the latency of a request.
+ * The throughput is what the last run got.
+ */
 static void
+plan_notification_xml(struct notification_xml *nxml, struct opts *opts)
+{
+	struct xmldata head[PLAN_SAMPLES + 1];
+	struct delta_item *d;
+	long long start, latency, throughput, delta_ms, snapshot_ms;
+	off_t delta_size = 0;
+	int i, n = 0, ndeltas, rounds, failed = 0;
+
+	memset(head, 0, sizeof(head));
+	head[n++].uri = nxml->snapshot_uri;
+	TAILQ_FOREACH(d, &nxml->delta_q, q) {
+		if (n == PLAN_SAMPLES + 1 ||
+		    (opts->delta_limit && n == opts->delta_limit + 1))
+			break;
+		head[n++].uri = d->uri;
+	}
+	start = getmonotime();
+	for (i = 0; i < n && !failed; i++) {
+		head[i].opts = opts;
+		head[i].spool_fd = -1;
+		head[i].head = 1;
+		if (fetch_xml_uri(&head[i]) != 200 || head[i].length <= 0)
+			failed = 1;
+		else if (i > 0)
+			delta_size += head[i].length;
+	}
+	if (failed || n == 1) {
+		log_debuginfo("plan: sizes not known, going for the deltas");
+		return;
+	}
+	if ((latency = (getmonotime() - start) / n) == 0)
+		latency = 1;
+	throughput = nxml->throughput > 0 ? nxml->throughput :
+	    PLAN_THROUGHPUT;
+	delta_size /= n - 1;
+
+	/* only the deltas that will be fetched count */
+	ndeltas = nxml->serial - nxml->current_serial;
+	if (opts->delta_limit && opts->delta_limit < ndeltas)
+		ndeltas = opts->delta_limit;
+	rounds = (ndeltas + opts->delta_jobs - 1) / opts->delta_jobs;
+	delta_ms = rounds * latency + ndeltas * delta_size * 1000 / throughput;
+	snapshot_ms = latency + head[0].length * 1000 / throughput;
+	log_info("plan: %d deltas of about %lld bytes take %lld ms, "
+	    "the snapshot of %lld bytes %lld ms (latency %lld ms, "
+	    "%lld bytes/s)", ndeltas, (long long)delta_size, delta_ms,
+	    (long long)head[0].length, snapshot_ms, latency, throughput);
+	if (snapshot_ms < delta_ms) {
+		log_info("plan: going for the snapshot");
+		nxml->state = NOTIFICATION_STATE_SNAPSHOT;
+	}
+}
+
+/*
+ * Bring the cachedir up to the notification, returns -1 if that failed.
+ */
+static int
 process_notification_xml(struct xmldata *xml_data, struct opts *opts)
 {
 	struct notification_xml *nxml = xml_data->xml_data;
+	struct xmldata *prefetch = NULL, *delta_data;
 	int num_deltas = 0;
 	int expected_deltas = 0;
+	int serial = nxml->serial;
 	struct delta_item *d;
+	long long start = getmonotime(), elapsed;
+	off_t received = opts->received;
+
+	if (nxml->state == NOTIFICATION_STATE_DELTAS) {
+		if (opts->plan == PLAN_SNAPSHOT) {
+			log_debuginfo("plan: always the snapshot");
+			nxml->state = NOTIFICATION_STATE_SNAPSHOT;
+		} else if (opts->plan == PLAN_COST)
+			plan_notification_xml(nxml, opts);
+	}
 
 	switch (nxml->state) {
 	case NOTIFICATION_STATE_ERROR:
-		fatalx("NOTIFICATION_STATE_ERROR");
+		log_warnx("NOTIFICATION_STATE_ERROR");
+		rm_working_dir(opts, 0);
+		return -1;
 	case NOTIFICATION_STATE_NONE:
 		rm_working_dir(opts, 0);
 		log_debuginfo("up to date");
-		return;
+		return 0;
 	case NOTIFICATION_STATE_DELTAS:
 		expected_deltas = nxml->serial - nxml->current_serial;
 		if (opts->delta_limit &&
@@ -96,27 +211,47 @@ process_notification_xml(struct xmldata *xml_data, struct opts *opts)
 			expected_deltas = opts->delta_limit;
 			/* XXXNF Hack to make this work */
 			xml_data->modified_since[0] = '\0';
+			xml_data->etag[0] = '\0';
+		}
+		/*
+		 * Falling back to the snapshot after a long chain costs both
+		 * downloads one after the other, better have it on the way.
+		 */
+		if (opts->hedge_deltas && (expected_deltas >=
+		    opts->hedge_deltas || nxml->delta_failures > 0)) {
+			log_debuginfo("prefetching snapshot");
+			prefetch = prefetch_snapshot_xml(nxml->snapshot_uri,
+			    nxml->snapshot_hash, opts);
 		}
 		log_debuginfo("fetching deltas");
-		while (!TAILQ_EMPTY(&(nxml->delta_q))) {
-			d = TAILQ_FIRST(&(nxml->delta_q));
-			TAILQ_REMOVE(&(nxml->delta_q), d, q);
-			/* XXXCJ check that uri points to same host */
-			if (num_deltas < opts->delta_limit ||
-			    !opts->delta_limit) {
-				if (fetch_delta_xml(d->uri, d->hash,
-				    opts, nxml) == 0)
-					num_deltas++;
-				else {
-					log_warnx("failed to fetch delta %s",
-					    d->uri);
-					free_delta(d);
-					break;
+		if (opts->delta_jobs > 1) {
+			num_deltas = fetch_deltas_parallel(expected_deltas,
+			    opts, nxml);
+			nxml->serial = nxml->current_serial + num_deltas;
+		} else {
+			delta_data = new_delta_xml_data(opts, nxml);
+			while (!TAILQ_EMPTY(&(nxml->delta_q))) {
+				d = TAILQ_FIRST(&(nxml->delta_q));
+				TAILQ_REMOVE(&(nxml->delta_q), d, q);
+				/* XXXCJ check that uri points to same host */
+				if (num_deltas < opts->delta_limit ||
+				    !opts->delta_limit) {
+					if (fetch_delta_xml(delta_data,
+					    d->uri, d->hash) == 0)
+						num_deltas++;
+					else {
+						log_warnx("failed to fetch "
+						    "delta %s", d->uri);
+						free_delta(d);
+						break;
+					}
 				}
+				free_delta(d);
+				/* in case we wrote fewer deltas */
+				nxml->serial = nxml->current_serial +
+				    num_deltas;
 			}
-			free_delta(d);
-			/* in case we wrote fewer deltas */
-			nxml->serial = nxml->current_serial + num_deltas;
+			free_delta_xml_data(delta_data);
 		}
 		/*
 		 * TODO should we apply as many deltas as possible or
@@ -128,6 +263,9 @@ process_notification_xml(struct xmldata *xml_data, struct opts *opts)
 			if (mv_delta(opts->basedir_working,
 			    opts->basedir_primary, opts->primary_dir) == 0) {
 				log_debuginfo("delta migrate passed");
+				nxml->delta_failures = 0;
+				if (prefetch != NULL)
+					cancel_snapshot_prefetch(prefetch);
 				break;
 			} else
 				log_warnx("delta migration failed");
@@ -136,15 +274,20 @@ process_notification_xml(struct xmldata *xml_data, struct opts *opts)
 			    expected_deltas);
 		/* Clean up the snapshot delta dir and make a new one */
 		rm_working_dir(opts, 1);
+		/* the snapshot is for the announced serial */
+		nxml->serial = serial;
+		nxml->delta_failures++;
 		log_warnx("deltas failed going to snapshot");
 		/* FALLTHROUGH */
 	case NOTIFICATION_STATE_SNAPSHOT:
 		log_debuginfo("fetching snapshot");
 		/* XXXCJ check that uri points to same host */
 		if (fetch_snapshot_xml(nxml->snapshot_uri,
-		    nxml->snapshot_hash, opts, nxml) != 0) {
+		    nxml->snapshot_hash, opts, nxml, prefetch) != 0) {
 			rm_working_dir(opts, 0);
-			fatalx("failed to run snapshot");
+			save_notification_failure(xml_data);
+			log_warnx("failed to run snapshot");
+			return -1;
 		}
 		/*
 		 * XXXNF bad things can happen here if we fail we have no
@@ -155,18 +298,204 @@ process_notification_xml(struct xmldata *xml_data, struct opts *opts)
 		    opts->basedir_primary, opts->primary_dir) != 0) {
 			rm_primary_dir(opts);
 			rm_working_dir(opts, 0);
-			fatal("failed to update");
+			log_warnx("failed to update");
+			return -1;
 		}
 		log_debuginfo("snapshot move success");
 	}
-	save_notification_data(xml_data);
+	/* remember what this run got, a short one says little */
+	elapsed = getmonotime() - start;
+	received = opts->received - received;
+	if (elapsed >= 100 && received >= 64 * 1024)
+		nxml->throughput = received * 1000 / elapsed;
+	return save_notification_data(xml_data);
+}
+
+/*
+ * Open the cachedir and make a working dir next to it. Both are unveiled,
+ * in batch mode this is done for every repository before the pledge.
+ */
+static int
+open_repo(char *cachedir, struct opts *opts)
+{
+	struct stat st;
+
+	if (stat(cachedir, &st) != 0) {
+		log_warn("%s: cachedir missing", cachedir);
+		return -1;
+	}
+	opts->basedir_primary = xstrdup(cachedir);
+	opts->primary_dir = open(opts->basedir_primary, O_RDONLY|O_DIRECTORY);
+	if (opts->primary_dir < 0) {
+		log_warn("failed to open dir: %s", cachedir);
+		free(opts->basedir_primary);
+		return -1;
+	}
+	if (make_workdir(opts->basedir_primary, opts) == -1) {
+		close(opts->primary_dir);
+		free(opts->basedir_primary);
+		return -1;
+	}
+	if (unveil(opts->basedir_primary, "crw") == -1)
+		fatal("%s: unveil", opts->basedir_primary);
+	if (unveil(opts->basedir_working, "crw") == -1)
+		fatal("%s: unveil", opts->basedir_working);
+	return 0;
+}
+
+/*
+ * Synchronise the repository at uri into the cachedir opened with
+ * open_repo(). Returns -1 if that failed.
+ */
+static int
+sync_repo(char *uri, struct opts *opts)
+{
+	struct xmldata *xml_data;
+	int ret = -1;
+
+	http_load_endpoints(opts);
+	if ((xml_data = fetch_notification_xml(uri, opts)) != NULL) {
+		ret = process_notification_xml(xml_data, opts);
+		free_xml_data(xml_data);
+	} else
+		rm_working_dir(opts, 0);
+	http_save_endpoints(opts);
+	close(opts->primary_dir);
+	free_workdir(opts);
+	free(opts->basedir_primary);
+	return ret;
+}
+
+struct repo {
+	TAILQ_ENTRY(repo)	 entry;
+	char			*uri;
+	char			*cachedir;
+	struct opts		 opts;
+	int			 opened;
+	int			 failed;
+};
+
+TAILQ_HEAD(repo_q, repo);
+
+struct batch {
+	struct repo_q		 repos;
+	struct repo		*next;
+};
+
+/*
+ * Read "uri cachedir" pairs, one per line. Empty lines and everything
+ * after a '#' are ignored.
+ */
+static void
+read_repo_list(const char *file, struct repo_q *repos)
+{
+	FILE *f;
+	struct repo *r;
+	char *line = NULL, *uri, *cachedir;
+	size_t linesize = 0;
+	int lineno = 0;
+
+	if (strcmp(file, "-") == 0)
+		f = stdin;
+	else if ((f = fopen(file, "r")) == NULL)
+		fatal("%s", file);
+	while (getline(&line, &linesize, f) != -1) {
+		lineno++;
+		line[strcspn(line, "#\r\n")] = '\0';
+		if ((uri = strtok(line, " \t")) == NULL)
+			continue;
+		if ((cachedir = strtok(NULL, " \t")) == NULL ||
+		    strtok(NULL, " \t") != NULL)
+			fatalx("%s:%d: expected \"uri cachedir\"", file,
+			    lineno);
+		if ((r = calloc(1, sizeof(struct repo))) == NULL)
+			fatal("%s - calloc", __func__);
+		r->uri = xstrdup(uri);
+		r->cachedir = xstrdup(cachedir);
+		TAILQ_INSERT_TAIL(repos, r, entry);
+	}
+	if (ferror(f))
+		fatal("%s", file);
+	free(line);
+	if (f != stdin)
+		fclose(f);
+}
+
+/*
+ * A job of the batch, it takes on one repository after the other. Only
+ * one job runs at a time, so they share the list without locking.
+ */
+static void
+sync_repo_job(void *arg)
+{
+	struct batch *b = arg;
+	struct repo *r;
+
+	while ((r = b->next) != NULL) {
+		b->next = TAILQ_NEXT(r, entry);
+		if (!r->opened)
+			continue;
+		log_debuginfo("%s: sync started", r->uri);
+		if (sync_repo(r->uri, &r->opts) != 0) {
+			log_warnx("%s: sync failed", r->uri);
+			r->failed = 1;
+		} else
+			log_debuginfo("%s: sync done", r->uri);
+	}
+}
+
+/*
+ * Synchronise every repository listed in file, each with its own opts
+ * and working dir, at most maxrepos at a time. They all run in this
+ * process and share the resolver cache, the endpoints, TLS sessions and
+ * idle connections. Returns the number of repositories that failed.
+ */
+static int
+sync_repo_list(const char *file, int maxrepos, struct opts *opts)
+{
+	struct batch b;
+	struct repo *r;
+	int n = 0, failed = 0;
+
+	TAILQ_INIT(&b.repos);
+	read_repo_list(file, &b.repos);
+	TAILQ_FOREACH(r, &b.repos, entry) {
+		r->opts = *opts;
+		if (open_repo(r->cachedir, &r->opts) == 0) {
+			r->opened = 1;
+			n++;
+		} else {
+			log_warnx("%s: sync failed", r->uri);
+			r->failed = 1;
+		}
+	}
+	if (unveil(NULL, NULL) == -1)
+		fatal("unveil");
+	if (pledge("dns inet tty stdio rpath wpath cpath fattr", NULL) == -1)
+		fatal("pledge");
+
+	b.next = TAILQ_FIRST(&b.repos);
+	if (n > 0)
+		http_jobs(sync_repo_job, &b, n < maxrepos ? n : maxrepos);
+	while ((r = TAILQ_FIRST(&b.repos)) != NULL) {
+		TAILQ_REMOVE(&b.repos, r, entry);
+		failed += r->failed;
+		free(r->uri);
+		free(r->cachedir);
+		free(r);
+	}
+	return failed;
 }
 
 static __dead void
 usage(void)
 {
-	fprintf(stderr, "usage: rrdp [-v] [-l delta_limit] [-i] "
-	    "-d cachedir uri\n");
+	fprintf(stderr, "usage: rrdp [-imrsvxz] [-e hedge] [-j jobs] "
+	    "[-l delta_limit] [-n parts]\n"
+	    "            [-t deltas | snapshot | cost] -d cachedir uri\n"
+	    "       rrdp [-imrsvxz] [-e hedge] [-j jobs] [-l delta_limit] "
+	    "[-n parts]\n"
+	    "            [-p repos] [-t deltas | snapshot | cost] -b file\n");
 	exit(1);
 }
 
@@ -176,39 +505,113 @@ main(int argc, char **argv)
 	struct opts opts;
 	char *cachedir = NULL;
 	char *uri = NULL;
-	char *basedir;
-	struct stat st;
-	int opt;
-	struct xmldata *xml_data;
+	char *batchfile = NULL;
+	int opt, maxrepos = 4, ret;
+	const char *errstr;
 	opts.delta_limit = 0;
+	opts.delta_jobs = 1;
 	opts.ignore_withdraw = 0;
 	opts.verbose = 0;
+	opts.compress = 0;
+	opts.save_sessions = 0;
+	opts.probe = 0;
+	opts.pipeline = 0;
+	opts.snapshot_parts = 1;
+	opts.hedge_deltas = 0;
+	opts.plan = PLAN_DELTAS;
+	opts.tokenizer = 0;
+	opts.received = 0;
 
-	if (pledge("dns inet tty stdio rpath wpath cpath fattr unveil", NULL) == -1)
+	if (pledge("dns inet tty stdio rpath wpath cpath fattr unveil",
+	    NULL) == -1)
 		fatal("pledge");
-	while ((opt = getopt(argc, argv, "d:f:il:v")) != -1) {
+	while ((opt = getopt(argc, argv, "b:d:e:f:ij:l:mn:p:rst:vxz")) != -1) {
 		switch (opt) {
+		case 'b':
+			batchfile = optarg;
+			break;
 		case 'd':
 			cachedir = optarg;
 			break;
+		case 'e':
+			opts.hedge_deltas = strtonum(optarg, 1, 100000,
+			    &errstr);
+			if (errstr != NULL)
+				errx(1, "hedge is %s: %s", errstr, optarg);
+			break;
 		case 'i':
 			opts.ignore_withdraw = 1;
 			break;
+		case 'j':
+			opts.delta_jobs = strtonum(optarg, 1, 64, &errstr);
+			if (errstr != NULL)
+				errx(1, "jobs is %s: %s", errstr, optarg);
+			break;
 		case 'l':
 			opts.delta_limit = (int)strtol(optarg, NULL, BASE10);
 			break;
+		case 'm':
+			opts.pipeline = 1;
+			break;
+		case 'n':
+			opts.snapshot_parts = strtonum(optarg, 1, 16, &errstr);
+			if (errstr != NULL)
+				errx(1, "parts is %s: %s", errstr, optarg);
+			break;
+		case 'p':
+			maxrepos = strtonum(optarg, 1, 256, &errstr);
+			if (errstr != NULL)
+				errx(1, "repos is %s: %s", errstr, optarg);
+			break;
+		case 'r':
+			opts.probe = 1;
+			break;
+		case 's':
+			opts.save_sessions = 1;
+			break;
+		case 't':
+			if (strcmp(optarg, "deltas") == 0)
+				opts.plan = PLAN_DELTAS;
+			else if (strcmp(optarg, "snapshot") == 0)
+				opts.plan = PLAN_SNAPSHOT;
+			else if (strcmp(optarg, "cost") == 0)
+				opts.plan = PLAN_COST;
+			else
+				errx(1, "unknown plan: %s", optarg);
+			break;
 		case 'v':
 			opts.verbose = 1;
 			break;
+		case 'x':
+			opts.tokenizer = 1;
+			break;
+		case 'z':
+			opts.compress = 1;
+			break;
 		default:
 			usage();
 		}
 	}
 
 	log_init(opts.verbose, LOG_USER);
+	/* a server may drop an idle connection we are about to write to */
+	signal(SIGPIPE, SIG_IGN);
 	argv += optind;
 	argc -= optind;
 
+	if ((opts.httpproxy = getenv(HTTP_PROXY)) != NULL &&
+	    *opts.httpproxy == '\0')
+		opts.httpproxy = NULL;
+	http_init();
+
+	if (batchfile != NULL) {
+		if (argc != 0 || cachedir != NULL)
+			usage();
+		ret = sync_repo_list(batchfile, maxrepos, &opts) != 0;
+		http_conn_pool_free();
+		return ret;
+	}
+
 	if (argc == 1)
 		uri = argv[0];
 	else
@@ -216,32 +619,13 @@ main(int argc, char **argv)
 
 	if (cachedir == NULL)
 		usage();
-	basedir = xstrdup(cachedir);
-	if (stat(basedir, &st) != 0)
-		fatal("cachedir missing");
-	opts.basedir_primary = basedir;
-	opts.primary_dir = open(opts.basedir_primary, O_RDONLY|O_DIRECTORY);
-	if (opts.primary_dir < 0)
-		fatal("failed to open dir: %s", basedir);
-	make_workdir(basedir, &opts);
-	if (unveil(basedir, "crw") == -1)
-		fatal("%s: unveil", basedir);
-	if (unveil(opts.basedir_working, "crw") == -1)
-		fatal("%s: unveil", opts.basedir_working);
-	if (unveil("/etc/ssl/", "r") == -1)
-		fatal("%s: unveil", "/etc/ssl/");
+	if (open_repo(cachedir, &opts) == -1)
+		return 1;
 	if (unveil(NULL, NULL) == -1)
 		fatal("unveil");
 	if (pledge("dns inet tty stdio rpath wpath cpath fattr", NULL) == -1)
 		fatal("pledge");
-	if ((opts.httpproxy = getenv(HTTP_PROXY)) != NULL &&
-	    *opts.httpproxy == '\0')
-		opts.httpproxy = NULL;
-
-	xml_data = fetch_notification_xml(uri, &opts);
-	process_notification_xml(xml_data, &opts);
-	free_xml_data(xml_data);
-	close(opts.primary_dir);
-	free_workdir(&opts);
-	free(basedir);
+	ret = sync_repo(uri, &opts) != 0;
+	http_conn_pool_free();
+	return ret;
 }
@@ -185,16 +185,30 @@ log_notification_xml(struct notification_xml *notification_xml)
 	    notification_xml->snapshot_hash ?: "NULL");
 }
 
+/*
+ * Nothing further down in the document can change what is done with it,
+ * stop the parser so the transfer can end early.
+ */
+static void
+stop_notification(struct xmldata *xml_data)
+{
+	struct notification_xml *notification_xml = xml_data->xml_data;
+
+	log_debuginfo("notification complete at serial %d",
+	    notification_xml->serial);
+	notification_xml->scope = NOTIFICATION_SCOPE_END;
+	xml_data->stop = 1;
+	xml_stop(xml_data);
+}
 
 static void
 start_notification_elem(struct xmldata *xml_data, const char **attr)
 {
-	XML_Parser p = xml_data->parser;
 	struct notification_xml *notification_xml = xml_data->xml_data;
 	int i;
 
 	if (notification_xml->scope != NOTIFICATION_SCOPE_START) {
-		PARSE_FAIL(p, "parse failed - entered notification "
+		PARSE_FAIL(xml_data, "parse failed - entered notification "
 		    "elem unexpectedely");
 	}
 	for (i = 0; attr[i]; i += 2) {
@@ -209,7 +223,7 @@ start_notification_elem(struct xmldata *xml_data, const char **attr)
 			notification_xml->serial =
 			    (int)strtol(attr[i+1], NULL, BASE10);
 		} else {
-			PARSE_FAIL(p, "parse failed - non conforming "
+			PARSE_FAIL(xml_data, "parse failed - non conforming "
 			    "attribute found in notification elem");
 		}
 	}
@@ -217,28 +231,30 @@ start_notification_elem(struct xmldata *xml_data, const char **attr)
 	      notification_xml->version &&
 	      notification_xml->session_id &&
 	      notification_xml->serial)) {
-		PARSE_FAIL(p, "parse failed - incomplete "
+		PARSE_FAIL(xml_data, "parse failed - incomplete "
 		    "notification attributes");
 	}
 
 	if (notification_xml->version <= 0 ||
 	    notification_xml->version > MAX_VERSION) {
-		PARSE_FAIL(p, "parse failed - invalid version");
+		PARSE_FAIL(xml_data, "parse failed - invalid version");
 	}
 	check_state(notification_xml);
 
 	notification_xml->scope = NOTIFICATION_SCOPE_NOTIFICATION;
+	/* up to date, the snapshot and deltas are not needed */
+	if (notification_xml->state == NOTIFICATION_STATE_NONE)
+		stop_notification(xml_data);
 }
 
 static void
 end_notification_elem(struct xmldata *xml_data)
 {
-	XML_Parser p = xml_data->parser;
 	struct notification_xml *notification_xml = xml_data->xml_data;
 
 	if (notification_xml->scope !=
 	    NOTIFICATION_SCOPE_NOTIFICATION_POST_SNAPSHOT) {
-		PARSE_FAIL(p, "parse failed - exited notification "
+		PARSE_FAIL(xml_data, "parse failed - exited notification "
 		    "elem unexpectedely");
 	}
 	notification_xml->scope = NOTIFICATION_SCOPE_END;
@@ -249,12 +265,11 @@ end_notification_elem(struct xmldata *xml_data)
 static void
 start_snapshot_elem(struct xmldata *xml_data, const char **attr)
 {
-	XML_Parser p = xml_data->parser;
 	struct notification_xml *notification_xml = xml_data->xml_data;
 	int i;
 
 	if (notification_xml->scope != NOTIFICATION_SCOPE_NOTIFICATION) {
-		PARSE_FAIL(p, "parse failed - entered snapshot "
+		PARSE_FAIL(xml_data, "parse failed - entered snapshot "
 		    "elem unexpectedely");
 	}
 	for (i = 0; attr[i]; i += 2) {
@@ -263,13 +278,14 @@ start_snapshot_elem(struct xmldata *xml_data, const char **attr)
 		else if (strcmp("hash", attr[i]) == 0)
 			notification_xml->snapshot_hash = xstrdup(attr[i+1]);
 		else {
-			PARSE_FAIL(p, "parse failed - non conforming "
+			PARSE_FAIL(xml_data, "parse failed - non conforming "
 			    "attribute found in snapshot elem");
 		}
 	}
 	if (!notification_xml->snapshot_uri ||
 	    !notification_xml->snapshot_hash) {
-		PARSE_FAIL(p, "parse failed - incomplete snapshot attributes");
+		PARSE_FAIL(xml_data,
+		    "parse failed - incomplete snapshot attributes");
 	}
 	notification_xml->scope = NOTIFICATION_SCOPE_SNAPSHOT;
 }
@@ -277,20 +293,24 @@ start_snapshot_elem(struct xmldata *xml_data, const char **attr)
 static void
 end_snapshot_elem(struct xmldata *xml_data)
 {
-	XML_Parser p = xml_data->parser;
 	struct notification_xml *notification_xml = xml_data->xml_data;
 
 	if (notification_xml->scope != NOTIFICATION_SCOPE_SNAPSHOT) {
-		PARSE_FAIL(p, "parse failed - exited snapshot "
+		PARSE_FAIL(xml_data, "parse failed - exited snapshot "
 		    "elem unexpectedely");
 	}
 	notification_xml->scope = NOTIFICATION_SCOPE_NOTIFICATION_POST_SNAPSHOT;
+	/* a new session or nothing local, the deltas are not needed */
+	if (notification_xml->current_session_id == NULL ||
+	    notification_xml->current_serial == 0 ||
+	    strcmp(notification_xml->current_session_id,
+	    notification_xml->session_id) != 0)
+		stop_notification(xml_data);
 }
 
 static void
 start_delta_elem(struct xmldata *xml_data, const char **attr)
 {
-	XML_Parser p = xml_data->parser;
 	struct notification_xml *notification_xml = xml_data->xml_data;
 	int i;
 	const char *delta_uri = NULL;
@@ -299,7 +319,7 @@ start_delta_elem(struct xmldata *xml_data, const char **attr)
 
 	if (notification_xml->scope !=
 	    NOTIFICATION_SCOPE_NOTIFICATION_POST_SNAPSHOT) {
-		PARSE_FAIL(p, "parse failed - entered delta "
+		PARSE_FAIL(xml_data, "parse failed - entered delta "
 		    "elem unexpectedely");
 	}
 	for (i = 0; attr[i]; i += 2) {
@@ -310,33 +330,44 @@ start_delta_elem(struct xmldata *xml_data, const char **attr)
 		else if (strcmp("serial", attr[i]) == 0)
 			delta_serial = (int)strtol(attr[i+1], NULL, BASE10);
 		else {
-			PARSE_FAIL(p, "parse failed - non conforming "
+			PARSE_FAIL(xml_data, "parse failed - non conforming "
 			    "attribute found in snapshot elem");
 		}
 	}
 	/* Only add to the list if we are relevant */
 	if (!delta_uri || !delta_hash || !delta_serial)
-		PARSE_FAIL(p, "parse failed - incomplete delta attributes");
+		PARSE_FAIL(xml_data,
+		    "parse failed - incomplete delta attributes");
 
 	if (notification_xml->current_serial &&
 	    notification_xml->current_serial < delta_serial) {
 		if (add_delta(notification_xml, delta_uri,
 		    delta_hash, delta_serial) == 0) {
-			PARSE_FAIL(p, "parse failed - adding delta failed");
+			PARSE_FAIL(xml_data,
+			    "parse failed - adding delta failed");
 		}
 		log_debuginfo("adding delta %d %s", delta_serial, delta_uri);
+		if (delta_serial <= notification_xml->serial)
+			notification_xml->ndeltas++;
 	}
 	notification_xml->scope = NOTIFICATION_SCOPE_DELTA;
+	/*
+	 * The deltas are distinct, so once there are as many in range as
+	 * the serials missing, they are all there.
+	 */
+	if (notification_xml->ndeltas ==
+	    notification_xml->serial - notification_xml->current_serial)
+		stop_notification(xml_data);
 }
 
 static void
 end_delta_elem(struct xmldata *xml_data)
 {
-	XML_Parser p = xml_data->parser;
 	struct notification_xml *notification_xml = xml_data->xml_data;
 
 	if (notification_xml->scope != NOTIFICATION_SCOPE_DELTA)
-		PARSE_FAIL(p, "parse failed - exited delta elem unexpectedely");
+		PARSE_FAIL(xml_data,
+		    "parse failed - exited delta elem unexpectedely");
 	notification_xml->scope = NOTIFICATION_SCOPE_NOTIFICATION_POST_SNAPSHOT;
 }
 
@@ -344,7 +375,6 @@ static void
 notification_xml_elem_start(void *data, const char *el, const char **attr)
 {
 	struct xmldata *xml_data = data;
-	XML_Parser p = xml_data->parser;
 
 	/*
 	 * Can only enter here once as we should have no ways to get back to
@@ -362,14 +392,14 @@ notification_xml_elem_start(void *data, const char *el, const char **attr)
 	else if (strcmp("delta", el) == 0)
 		start_delta_elem(data, attr);
 	else
-		PARSE_FAIL(p, "parse failed - unexpected elem exit found");
+		PARSE_FAIL(xml_data,
+		    "parse failed - unexpected elem exit found");
 }
 
 static void
 notification_xml_elem_end(void *data, const char *el)
 {
 	struct xmldata *xml_data = data;
-	XML_Parser p = xml_data->parser;
 
 	if (strcmp("notification", el) == 0)
 		end_notification_elem(data);
@@ -378,12 +408,14 @@ notification_xml_elem_end(void *data, const char *el)
 	else if (strcmp("delta", el) == 0)
 		end_delta_elem(data);
 	else
-		PARSE_FAIL(p, "parse failed - unexpected elem exit found");
+		PARSE_FAIL(xml_data,
+		    "parse failed - unexpected elem exit found");
 }
 
 /* XXXCJ this needs more cleanup and error checking */
-void
-save_notification_data(struct xmldata *xml_data)
+static int
+write_notification_data(struct xmldata *xml_data, const char *session_id,
+    int serial)
 {
 	int fd;
 	FILE *f = NULL;
@@ -394,15 +426,53 @@ save_notification_data(struct xmldata *xml_data)
 
 	fd = openat(xml_data->opts->primary_dir, STATE_FILENAME,
 	    O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
-	if (fd < 0 || !(f = fdopen(fd, "w")))
-		fatal("%s - fdopen", __func__);
+	if (fd < 0 || !(f = fdopen(fd, "w"))) {
+		log_warn("%s/%s", xml_data->opts->basedir_primary,
+		    STATE_FILENAME);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	fprintf(f, "%s\n%d\n%s\n%s\n%d\n%lld\n", session_id, serial,
+	    xml_data->modified_since, xml_data->etag, nxml->delta_failures,
+	    nxml->throughput);
+	if (fclose(f) == EOF) {
+		log_warn("%s/%s", xml_data->opts->basedir_primary,
+		    STATE_FILENAME);
+		return -1;
+	}
+	return 0;
+}
+
+int
+save_notification_data(struct xmldata *xml_data)
+{
+	struct notification_xml *nxml = xml_data->xml_data;
+
 	/*
 	 * TODO maybe this should actually come from the snapshot/deltas that
 	 * get written might not matter if we have verified consistency already
 	 */
-	fprintf(f, "%s\n%d\n%s\n", nxml->session_id, nxml->serial,
-	    xml_data->modified_since);
-	fclose(f);
+	return write_notification_data(xml_data, nxml->session_id,
+	    nxml->serial);
+}
+
+/*
+ * The snapshot failed as well, the cachedir still holds the current session
+ * and serial. Keep those but remember the failed deltas. The validators
+ * describe a notification that was not applied, drop them.
+ */
+void
+save_notification_failure(struct xmldata *xml_data)
+{
+	struct notification_xml *nxml = xml_data->xml_data;
+
+	if (nxml->current_session_id == NULL)
+		return;
+	xml_data->modified_since[0] = '\0';
+	xml_data->etag[0] = '\0';
+	write_notification_data(xml_data, nxml->current_session_id,
+	    nxml->current_serial);
 }
 
 /* XXXCJ this needs more cleanup and error checking */
@@ -426,7 +496,7 @@ fetch_existing_notification_data(struct xmldata *xml_data)
 		return;
 	}
 
-	while (l < 3 && (s = getline(&line, &len, f)) != -1) {
+	while (l < 6 && (s = getline(&line, &len, f)) != -1) {
 		/* must have at least 1 char serial / session */
 		if (s <= 1 && l < 2) {
 			fclose(f);
@@ -449,12 +519,20 @@ fetch_existing_notification_data(struct xmldata *xml_data)
 				log_warnx("bad time in notification file: '%s'",
 				    line);
 			}
-		}
+		} else if (l == 3)
+			strlcpy(xml_data->etag, line, VALIDATOR_LEN);
+		else if (l == 4)
+			nxml->delta_failures = (int)strtol(line, NULL,
+			    BASE10);
+		else if (l == 5)
+			nxml->throughput = strtoll(line, NULL, BASE10);
 		l++;
 	}
-	log_debug("current session: %s\ncurrent serial: %d\nmodified since: %s",
+	log_debug("current session: %s\ncurrent serial: %d\nmodified since: %s"
+	    "\netag: %s\ndelta failures: %d\nthroughput: %lld",
 	    nxml->current_session_id ?: "NULL", nxml->current_serial,
-	    xml_data->modified_since);
+	    xml_data->modified_since, xml_data->etag, nxml->delta_failures,
+	    nxml->throughput);
 	fclose(f);
 }
 
@@ -482,6 +560,7 @@ new_notification_xml_data(char *uri, struct opts *opts)
 	XML_SetElementHandler(xml_data->parser, notification_xml_elem_start,
 	    notification_xml_elem_end);
 	XML_SetUserData(xml_data->parser, xml_data);
+	xml_data->spool_fd = -1;
 
 	return xml_data;
 }
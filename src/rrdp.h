@@ -23,35 +23,73 @@ struct opts {
 	int primary_dir;
 	int working_dir;
 	int delta_limit;
+	int delta_jobs;
 	int ignore_withdraw;
 	int verbose;
+	int compress;
+	int save_sessions;
+	int probe;
+	int pipeline;
+	int snapshot_parts;
+	int hedge_deltas;
+	int plan;
+	int tokenizer;
+	/* bytes read for this repository, for measuring throughput */
+	off_t received;
 };
 
-int	b64_decode(char *, unsigned char **);
+/* how to catch up with a contiguous delta chain (-t) */
+#define PLAN_DELTAS	0
+#define PLAN_SNAPSHOT	1
+#define PLAN_COST	2
+
+#define B64_CHUNK 4096
+
+enum b64_pad {
+	B64_PAD_NONE,
+	B64_PAD_ONE_MORE,
+	B64_PAD_DONE
+};
+
+struct b64_state {
+	unsigned int	bits;
+	int		count;
+	enum b64_pad	pad;
+};
+
+void	b64_decode_init(struct b64_state *);
+int	b64_decode_write(struct b64_state *, const char *, size_t, FILE *);
+int	b64_decode_final(struct b64_state *);
 char 	*xstrdup(const char *);
 
 FILE 	*open_primary_uri_read(char *, struct opts *);
 FILE 	*open_working_uri_read(char *, struct opts *);
 FILE 	*open_working_uri_write(char *, struct opts *);
-void	make_workdir(const char *, struct opts *);
+int	make_workdir(const char *, struct opts *);
 void	free_workdir(struct opts *);
 
 /* file_util */
 int mkpath_at(int, const char *);
-int rm_dir(char *, int);
+int rm_dir(char *, int, int);
 int mv_delta(char *, char *, int);
 
 /* fetch_util */ 
 #define TIME_FORMAT "%a, %d %b %Y %T GMT"
 #define TIME_LEN 30
+#define VALIDATOR_LEN 128
+#define TLS_SESSION_FILENAME ".tls-session."
+#define ENDPOINT_FILENAME ".endpoints"
 
 /* save everyone doing this code over and over */
-#define PARSE_FAIL(p, ...) do {		\
-	XML_StopParser(p, XML_FALSE);	\
+#define PARSE_FAIL(data, ...) do {	\
+	xml_stop(data);			\
 	log_warnx(__VA_ARGS__);		\
 	return;				\
 } while(0)
 
+struct http_request;
+struct xml_tok;
+
 struct xmldata {
 	struct opts *opts;
 	char *uri;
@@ -59,10 +97,46 @@ struct xmldata {
 	char modified_since[TIME_LEN];
 	SHA256_CTX ctx;
 	XML_Parser parser;
+	/* RRDP tokenizer used instead of the parser, if set */
+	struct xml_tok *tok;
+	/* expat memory handed out by xml_buffer() */
+	char *buffer;
 	void *xml_data;
+	int spool_fd;
+	off_t range_start;
+	off_t range_end;
+	/* ask for the headers only, the body length ends up in length */
+	int head;
+	off_t length;
+	/* large transfer, nothing is pipelined along with it */
+	int bulk;
+	char validator[VALIDATOR_LEN];
+	char etag[VALIDATOR_LEN];
+	struct http_request *req;
+	/* set by the parser once the rest of the document does not matter */
+	int stop;
 };
 
-long fetch_xml_uri(struct xmldata *);
+long	fetch_xml_uri(struct xmldata *);
+void	fetch_xml_start(struct xmldata *);
+int	fetch_xml_wait_any(struct xmldata **, int);
+long	fetch_xml_wait(struct xmldata *);
+void	fetch_xml_cancel(struct xmldata *);
+int	parse_xml_file(struct xmldata *, int);
+void	http_init(void);
+void	http_jobs(void (*)(void *), void *, int);
+long long	getmonotime(void);
+void	http_load_endpoints(struct opts *);
+void	http_save_endpoints(struct opts *);
+void	http_conn_pool_free(void);
+
+/* xml */
+void	xml_tok_init(struct xmldata *, XML_StartElementHandler,
+	    XML_EndElementHandler, XML_CharacterDataHandler);
+void	xml_tok_free(struct xmldata *);
+char	*xml_buffer(struct xmldata *, size_t);
+int	xml_parse(struct xmldata *, char *, size_t, int);
+void	xml_stop(struct xmldata *);
 
 /* notification */
 #define STATE_FILENAME ".state"
@@ -106,6 +180,11 @@ struct notification_xml {
 	char			*snapshot_uri;
 	char			*snapshot_hash;
 	struct delta_q		delta_q;
+	int			ndeltas;
+	/* runs in a row where the deltas failed */
+	int			delta_failures;
+	/* bytes/s the last run got done, 0 if not known */
+	long long		throughput;
 	enum notification_state	state;
 };
 
@@ -114,15 +193,32 @@ void			free_notification_xml(struct notification_xml *);
 void			log_notification_xml(struct notification_xml *);
 void			check_state(struct notification_xml *);
 
+/* enough for the xml declaration and the notification start tag */
+#define NOTIFICATION_PROBE_SIZE 4096
+
 struct xmldata	*new_notification_xml_data(char *, struct opts *);
 void		free_xml_data(struct xmldata *);
-void		save_notification_data(struct xmldata *);
+int		save_notification_data(struct xmldata *);
+void		save_notification_failure(struct xmldata *);
 
 /* snapshot */
-int fetch_snapshot_xml(char *, char *, struct opts *, struct notification_xml*);
+#define SNAPSHOT_SPOOL_FILENAME ".snapshot"
+#define SNAPSHOT_META_FILENAME ".snapshot.meta"
+/* smaller parts are not worth another connection */
+#define SNAPSHOT_PART_MIN (1024 * 1024)
+
+int fetch_snapshot_xml(char *, char *, struct opts *, struct notification_xml*,
+    struct xmldata *);
+struct xmldata	*prefetch_snapshot_xml(char *, char *, struct opts *);
+void		cancel_snapshot_prefetch(struct xmldata *);
 
 /* delta */
-int fetch_delta_xml(char *, char *, struct opts *, struct notification_xml*);
+#define DELTA_SPOOL_FILENAME ".delta"
+
+struct xmldata	*new_delta_xml_data(struct opts *, struct notification_xml *);
+void		free_delta_xml_data(struct xmldata *);
+int		fetch_delta_xml(struct xmldata *, char *, char *);
+int fetch_deltas_parallel(int, struct opts *, struct notification_xml *);
 
 #endif /* _RRDPH_ */
 
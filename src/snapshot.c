@@ -14,12 +14,16 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
 #include <unistd.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
 
 #include <expat.h>
 
@@ -40,8 +44,8 @@ struct snapshot_xml {
 	char			*session_id;
 	int			serial;
 	char			*publish_uri;
-	char			*publish_data;
-	unsigned int		publish_data_length;
+	FILE			*publish_file;
+	struct b64_state	publish_b64;
 	struct notification_xml	*nxml;
 };
 
@@ -69,15 +73,15 @@ static void
 zero_snapshot_publish_data(struct snapshot_xml *snapshot_xml)
 {
 	snapshot_xml->publish_uri = NULL;
-	snapshot_xml->publish_data = NULL;
-	snapshot_xml->publish_data_length = 0;
+	snapshot_xml->publish_file = NULL;
 }
 
 static void
 free_snapshot_publish_data(struct snapshot_xml *snapshot_xml)
 {
 	free(snapshot_xml->publish_uri);
-	free(snapshot_xml->publish_data);
+	if (snapshot_xml->publish_file != NULL)
+		fclose(snapshot_xml->publish_file);
 	zero_snapshot_publish_data(snapshot_xml);
 }
 
@@ -86,41 +90,21 @@ free_snapshot_xml_data(struct xmldata *xml_data)
 {
 	struct snapshot_xml *snapshot_xml = xml_data->xml_data;
 	XML_ParserFree(xml_data->parser);
+	xml_tok_free(xml_data);
 	free(snapshot_xml->xmlns);
 	free(snapshot_xml->session_id);
 	zero_snapshot_global_data(snapshot_xml);
 	free_snapshot_publish_data(xml_data->xml_data);
 }
 
-static void
-write_snapshot_publish(struct xmldata *xml_data)
-{
-	struct snapshot_xml *snapshot_xml = xml_data->xml_data;
-	FILE *f;
-	unsigned char *data_decoded;
-	int decoded_len;
-
-	f = open_working_uri_write(snapshot_xml->publish_uri, xml_data->opts);
-	if (f == NULL)
-		fatal("%s - file open fail", __func__);
-	/* decode b64 message */
-	decoded_len = b64_decode(snapshot_xml->publish_data, &data_decoded);
-	if (decoded_len > 0) {
-		fwrite(data_decoded, 1, decoded_len, f);
-		free(data_decoded);
-	}
-	fclose(f);
-}
-
 static void
 start_snapshot_elem(struct xmldata *xml_data, const char **attr)
 {
-	XML_Parser p = xml_data->parser;
 	struct snapshot_xml *snapshot_xml = xml_data->xml_data;
 	int i;
 
 	if (snapshot_xml->scope != SNAPSHOT_SCOPE_NONE) {
-		PARSE_FAIL(p,
+		PARSE_FAIL(xml_data,
 		    "parse failed - entered snapshot elem unexpectedely");
 	}
 	for (i = 0; attr[i]; i += 2) {
@@ -135,7 +119,7 @@ start_snapshot_elem(struct xmldata *xml_data, const char **attr)
 			snapshot_xml->serial =
 			    (int)strtol(attr[i+1], NULL, BASE10);
 		else {
-			PARSE_FAIL(p,
+			PARSE_FAIL(xml_data,
 			    "parse failed - non conforming "
 			    "attribute found in snapshot elem");
 		}
@@ -144,17 +128,17 @@ start_snapshot_elem(struct xmldata *xml_data, const char **attr)
 	      snapshot_xml->version &&
 	      snapshot_xml->session_id &&
 	      snapshot_xml->serial)) {
-		PARSE_FAIL(p,
+		PARSE_FAIL(xml_data,
 		    "parse failed - incomplete snapshot attributes");
 	}
 	if (snapshot_xml->version <= 0 ||
 	    snapshot_xml->version > MAX_VERSION)
-		PARSE_FAIL(p, "parse failed - invalid version");
+		PARSE_FAIL(xml_data, "parse failed - invalid version");
 	if (strcmp(snapshot_xml->nxml->session_id,
 	    snapshot_xml->session_id) != 0)
-		PARSE_FAIL(p, "parse failed - session_id mismatch");
+		PARSE_FAIL(xml_data, "parse failed - session_id mismatch");
 	if (snapshot_xml->nxml->serial != snapshot_xml->serial)
-		PARSE_FAIL(p, "parse failed - serial mismatch");
+		PARSE_FAIL(xml_data, "parse failed - serial mismatch");
 
 	snapshot_xml->scope = SNAPSHOT_SCOPE_SNAPSHOT;
 }
@@ -162,11 +146,10 @@ start_snapshot_elem(struct xmldata *xml_data, const char **attr)
 static void
 end_snapshot_elem(struct xmldata *xml_data)
 {
-	XML_Parser p = xml_data->parser;
 	struct snapshot_xml *snapshot_xml = xml_data->xml_data;
 
 	if (snapshot_xml->scope != SNAPSHOT_SCOPE_SNAPSHOT) {
-		PARSE_FAIL(p, "parse failed - exited snapshot "
+		PARSE_FAIL(xml_data, "parse failed - exited snapshot "
 		    "elem unexpectedely");
 	}
 	snapshot_xml->scope = SNAPSHOT_SCOPE_END;
@@ -175,12 +158,11 @@ end_snapshot_elem(struct xmldata *xml_data)
 static void
 start_publish_elem(struct xmldata *xml_data, const char **attr)
 {
-	XML_Parser p = xml_data->parser;
 	struct snapshot_xml *snapshot_xml = xml_data->xml_data;
 	int i;
 
 	if (snapshot_xml->scope != SNAPSHOT_SCOPE_SNAPSHOT) {
-		PARSE_FAIL(p, "parse failed - entered publish "
+		PARSE_FAIL(xml_data, "parse failed - entered publish "
 		    "elem unexpectedely");
 	}
 	for (i = 0; attr[i]; i += 2) {
@@ -189,30 +171,39 @@ start_publish_elem(struct xmldata *xml_data, const char **attr)
 		else if (strcmp("xmlns", attr[i]) == 0);
 			/* XXX should we do nothing? */
 		else {
-			PARSE_FAIL(p, "parse failed - non conforming"
+			PARSE_FAIL(xml_data, "parse failed - non conforming"
 			    " attribute found in publish elem");
 		}
 	}
 	if (!snapshot_xml->publish_uri)
-		PARSE_FAIL(p, "parse failed - incomplete publish attributes");
+		PARSE_FAIL(xml_data,
+		    "parse failed - incomplete publish attributes");
+	/* the content is decoded straight into the file */
+	snapshot_xml->publish_file = open_working_uri_write(
+	    snapshot_xml->publish_uri, xml_data->opts);
+	if (snapshot_xml->publish_file == NULL)
+		PARSE_FAIL(xml_data, "failed to open %s",
+		    snapshot_xml->publish_uri);
+	b64_decode_init(&snapshot_xml->publish_b64);
 	snapshot_xml->scope = SNAPSHOT_SCOPE_PUBLISH;
 }
 
 static void
 end_publish_elem(struct xmldata *xml_data)
 {
-	XML_Parser p = xml_data->parser;
 	struct snapshot_xml *snapshot_xml = xml_data->xml_data;
 
 	if (snapshot_xml->scope != SNAPSHOT_SCOPE_PUBLISH) {
-		PARSE_FAIL(p, "parse failed - exited publish "
+		PARSE_FAIL(xml_data, "parse failed - exited publish "
 		    "elem unexpectedely");
 	}
 	if (!snapshot_xml->publish_uri) {
-		PARSE_FAIL(p, "parse failed - no data recovered "
+		PARSE_FAIL(xml_data, "parse failed - no data recovered "
 		    "from publish elem");
 	}
-	write_snapshot_publish(xml_data);
+	if (b64_decode_final(&snapshot_xml->publish_b64) == -1)
+		PARSE_FAIL(xml_data, "failed to b64 decode %s",
+		    snapshot_xml->publish_uri);
 	free_snapshot_publish_data(snapshot_xml);
 	snapshot_xml->scope = SNAPSHOT_SCOPE_SNAPSHOT;
 }
@@ -221,7 +212,6 @@ static void
 snapshot_xml_elem_start(void *data, const char *el, const char **attr)
 {
 	struct xmldata *xml_data = data;
-	XML_Parser p = xml_data->parser;
 
 	/*
 	 * Can only enter here once as we should have no ways to get back to
@@ -231,62 +221,48 @@ snapshot_xml_elem_start(void *data, const char *el, const char **attr)
 		start_snapshot_elem(data, attr);
 	/*
 	 * Will enter here multiple times, BUT never nested. will start
-	 * collecting character data in that handler mem is cleared in end
-	 * block, (TODO or on parse failure)
+	 * decoding character data in that handler, the file is closed in
+	 * the end block or on cleanup after a parse failure
 	 */
 	else if (strcmp("publish", el) == 0)
 		start_publish_elem(data, attr);
 	else
-		PARSE_FAIL(p, "parse failed - unexpected elem exit found");
+		PARSE_FAIL(xml_data,
+		    "parse failed - unexpected elem exit found");
 }
 
 static void
 snapshot_xml_elem_end(void *data, const char *el)
 {
 	struct xmldata *xml_data = data;
-	XML_Parser p = xml_data->parser;
 
 	if (strcmp("snapshot", el) == 0)
 		end_snapshot_elem(data);
 	else if (strcmp("publish", el) == 0)
 		end_publish_elem(data);
 	else
-		PARSE_FAIL(p, "parse failed - unexpected elem exit found");
+		PARSE_FAIL(xml_data,
+		    "parse failed - unexpected elem exit found");
 }
 
 static void
 snapshot_content_handler(void *data, const char *content, int length)
 {
-	int new_length;
 	struct xmldata *xml_data = data;
 	struct snapshot_xml *snapshot_xml = xml_data->xml_data;
 
-	if (snapshot_xml->scope == SNAPSHOT_SCOPE_PUBLISH) {
-		/*
-		 * optmisiation, this often gets called with '\n' as the
-		 * only data... seems wasteful
-		 */
-		if (length == 1 && content[0] == '\n')
-			return;
-
-		/* append content to publish_data */
-		new_length = snapshot_xml->publish_data_length + length;
-		snapshot_xml->publish_data = realloc(snapshot_xml->publish_data,
-		    new_length + 1);
-		if (snapshot_xml->publish_data == NULL)
-			fatal("%s - realloc", __func__);
-
-		memcpy(snapshot_xml->publish_data +
-		    snapshot_xml->publish_data_length, content, length);
-		snapshot_xml->publish_data[new_length] = '\0';
-		snapshot_xml->publish_data_length = new_length;
-	}
+	if (snapshot_xml->scope == SNAPSHOT_SCOPE_PUBLISH &&
+	    b64_decode_write(&snapshot_xml->publish_b64, content, length,
+	    snapshot_xml->publish_file) == -1)
+		PARSE_FAIL(xml_data, "failed to b64 decode %s",
+		    snapshot_xml->publish_uri);
 }
 
 static void
 setup_xml_data(struct xmldata *xml_data, struct snapshot_xml *snapshot_xml,
     char *uri, char *hash, struct opts *opts, struct notification_xml *nxml)
 {
+	memset(xml_data, 0, sizeof(*xml_data));
 	xml_data->uri = uri;
 	xml_data->opts = opts;
 	xml_data->hash = hash;
@@ -300,6 +276,10 @@ setup_xml_data(struct xmldata *xml_data, struct snapshot_xml *snapshot_xml,
 	    snapshot_xml_elem_end);
 	XML_SetCharacterDataHandler(xml_data->parser, snapshot_content_handler);
 	XML_SetUserData(xml_data->parser, xml_data);
+	if (opts->tokenizer)
+		xml_tok_init(xml_data, snapshot_xml_elem_start,
+		    snapshot_xml_elem_end, snapshot_content_handler);
+	xml_data->spool_fd = -1;
 
 	xml_data->xml_data = snapshot_xml;
 	zero_snapshot_global_data(snapshot_xml);
@@ -307,17 +287,308 @@ setup_xml_data(struct xmldata *xml_data, struct snapshot_xml *snapshot_xml,
 	snapshot_xml->nxml = nxml;
 }
 
+/*
+ * Snapshots are downloaded into a spool file in the cachedir first so
+ * that the next run can resume a transfer that was cut short. The meta
+ * file records uri, hash and validator of the snapshot in the spool.
+ */
+static int
+read_snapshot_meta(struct opts *opts, char *uri, char *hash, char *validator)
+{
+	FILE *f;
+	char *line = NULL;
+	size_t len = 0;
+	ssize_t s;
+	int fd, l = 0, ret = -1;
+
+	fd = openat(opts->primary_dir, SNAPSHOT_META_FILENAME, O_RDONLY);
+	if (fd < 0 || !(f = fdopen(fd, "r"))) {
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	while (l < 3 && (s = getline(&line, &len, f)) != -1) {
+		if (s > 0 && line[s - 1] == '\n')
+			line[s - 1] = '\0';
+		if (l == 0 && strcmp(line, uri) != 0)
+			break;
+		if (l == 1 && strcasecmp(line, hash) != 0)
+			break;
+		if (l == 2) {
+			strlcpy(validator, line, VALIDATOR_LEN);
+			ret = 0;
+		}
+		l++;
+	}
+	free(line);
+	fclose(f);
+	return ret;
+}
+
+static void
+write_snapshot_meta(struct opts *opts, char *uri, char *hash, char *validator)
+{
+	FILE *f = NULL;
+	int fd;
+
+	fd = openat(opts->primary_dir, SNAPSHOT_META_FILENAME,
+	    O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+	if (fd < 0 || !(f = fdopen(fd, "w"))) {
+		log_warn("%s - open %s", __func__, SNAPSHOT_META_FILENAME);
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	fprintf(f, "%s\n%s\n%s\n", uri, hash, validator);
+	fclose(f);
+}
+
+static void
+remove_snapshot_spool(struct opts *opts)
+{
+	if (unlinkat(opts->primary_dir, SNAPSHOT_SPOOL_FILENAME, 0) == -1 &&
+	    errno != ENOENT)
+		log_warn("%s - unlink %s", __func__, SNAPSHOT_SPOOL_FILENAME);
+	if (unlinkat(opts->primary_dir, SNAPSHOT_META_FILENAME, 0) == -1 &&
+	    errno != ENOENT)
+		log_warn("%s - unlink %s", __func__, SNAPSHOT_META_FILENAME);
+}
+
+/*
+ * Download the snapshot as opts->snapshot_parts byte ranges side by side
+ * into the preallocated spool file. Returns -1 if the server can not do
+ * this and the snapshot has to come in one piece.
+ */
+static int
+fetch_snapshot_parts(char *uri, struct opts *opts, int fd)
+{
+	struct xmldata head, *parts, **set;
+	off_t size, partsize;
+	int i, n, nparts, ret = -1;
+
+	memset(&head, 0, sizeof(head));
+	head.uri = uri;
+	head.opts = opts;
+	head.spool_fd = -1;
+	head.head = 1;
+	if (fetch_xml_uri(&head) != 200 || head.length <= 0)
+		return -1;
+	size = head.length;
+	nparts = opts->snapshot_parts;
+	if (size / nparts < SNAPSHOT_PART_MIN)
+		nparts = size / SNAPSHOT_PART_MIN;
+	if (nparts < 2)
+		return -1;
+	if (ftruncate(fd, size) == -1) {
+		log_warn("%s - truncate %s", __func__, SNAPSHOT_SPOOL_FILENAME);
+		return -1;
+	}
+	log_info("fetching %s in %d parts of %lld bytes", uri, nparts,
+	    (long long)size);
+
+	if ((parts = calloc(nparts, sizeof(*parts))) == NULL ||
+	    (set = calloc(nparts, sizeof(*set))) == NULL)
+		fatal("%s - calloc", __func__);
+	for (i = 0; i < nparts; i++)
+		parts[i].spool_fd = -1;
+	partsize = (size + nparts - 1) / nparts;
+	for (i = 0; i < nparts; i++) {
+		parts[i].uri = uri;
+		parts[i].opts = opts;
+		parts[i].bulk = 1;
+		parts[i].range_start = i * partsize;
+		parts[i].range_end = i == nparts - 1 ? size - 1 :
+		    parts[i].range_start + partsize - 1;
+		/* every part writes through its own file offset */
+		parts[i].spool_fd = openat(opts->primary_dir,
+		    SNAPSHOT_SPOOL_FILENAME, O_WRONLY);
+		if (parts[i].spool_fd == -1 ||
+		    lseek(parts[i].spool_fd, parts[i].range_start,
+		    SEEK_SET) == -1) {
+			log_warn("%s - open %s", __func__,
+			    SNAPSHOT_SPOOL_FILENAME);
+			goto out;
+		}
+		fetch_xml_start(&parts[i]);
+	}
+
+	for (;;) {
+		n = 0;
+		for (i = 0; i < nparts; i++)
+			if (parts[i].req != NULL)
+				set[n++] = &parts[i];
+		if (n == 0)
+			break;
+		i = fetch_xml_wait_any(set, n);
+		if (fetch_xml_wait(set[i]) != 206) {
+			log_warnx("failed to fetch part of %s", uri);
+			goto out;
+		}
+	}
+	ret = 0;
+out:
+	for (i = 0; i < nparts; i++) {
+		if (parts[i].req != NULL)
+			fetch_xml_cancel(&parts[i]);
+		if (parts[i].spool_fd != -1)
+			close(parts[i].spool_fd);
+	}
+	free(set);
+	free(parts);
+	return ret;
+}
+
+/*
+ * Open the spool file for the snapshot at uri, keeping what an earlier run
+ * left there if it is a spool of this very snapshot.
+ */
+static int
+open_snapshot_spool(struct xmldata *spool, char *uri, char *hash,
+    struct opts *opts)
+{
+	struct stat st;
+
+	memset(spool, 0, sizeof(*spool));
+	spool->uri = uri;
+	spool->opts = opts;
+	spool->bulk = 1;
+	spool->spool_fd = openat(opts->primary_dir, SNAPSHOT_SPOOL_FILENAME,
+	    O_RDWR|O_CREAT, S_IRUSR|S_IWUSR);
+	if (spool->spool_fd == -1) {
+		log_warn("%s - open %s", __func__, SNAPSHOT_SPOOL_FILENAME);
+		return -1;
+	}
+	/* only a spool of this very snapshot can be resumed */
+	if (read_snapshot_meta(opts, uri, hash, spool->validator) == 0 &&
+	    fstat(spool->spool_fd, &st) == 0)
+		spool->range_start = st.st_size;
+	else if (ftruncate(spool->spool_fd, 0) == -1) {
+		log_warn("%s - truncate %s", __func__,
+		    SNAPSHOT_SPOOL_FILENAME);
+		close(spool->spool_fd);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Start the download into the spool as a single stream, resuming at the
+ * end of what is there already.
+ */
+static int
+start_snapshot_spool(struct xmldata *spool, char *hash)
+{
+	if (lseek(spool->spool_fd, spool->range_start, SEEK_SET) == -1) {
+		log_warn("%s - lseek", __func__);
+		return -1;
+	}
+	if (spool->range_start > 0)
+		log_info("resuming %s at byte %lld", spool->uri,
+		    (long long)spool->range_start);
+	write_snapshot_meta(spool->opts, spool->uri, hash, spool->validator);
+	fetch_xml_start(spool);
+	return 0;
+}
+
+/*
+ * Start downloading the snapshot in the background, the transfer makes
+ * progress while the deltas are downloaded. Returns NULL on failure.
+ */
+struct xmldata *
+prefetch_snapshot_xml(char *uri, char *hash, struct opts *opts)
+{
+	struct xmldata *spool;
+
+	if ((spool = malloc(sizeof(*spool))) == NULL)
+		fatal("%s - malloc", __func__);
+	if (open_snapshot_spool(spool, uri, hash, opts) == -1) {
+		free(spool);
+		return NULL;
+	}
+	if (start_snapshot_spool(spool, hash) == -1) {
+		close(spool->spool_fd);
+		free(spool);
+		return NULL;
+	}
+	return spool;
+}
+
+/*
+ * The snapshot is not needed after all, stop its download and drop it.
+ */
+void
+cancel_snapshot_prefetch(struct xmldata *spool)
+{
+	if (spool->req != NULL)
+		fetch_xml_cancel(spool);
+	close(spool->spool_fd);
+	remove_snapshot_spool(spool->opts);
+	free(spool);
+}
+
+/*
+ * Download, check and apply the snapshot. If prefetch is set the download
+ * started by prefetch_snapshot_xml() is finished instead, it is freed.
+ */
 int
 fetch_snapshot_xml(char *uri, char *hash, struct opts *opts,
-    struct notification_xml* nxml)
+    struct notification_xml* nxml, struct xmldata *prefetch)
 {
-	struct xmldata xml_data;
+	struct xmldata xml_data, local, *spool = prefetch;
 	struct snapshot_xml snapshot_xml;
-	int ret = 0;
+	long status;
+	int ret = 1;
+
+	if (spool != NULL)
+		log_info("finishing the prefetched %s", uri);
+	else {
+		spool = &local;
+		if (open_snapshot_spool(spool, uri, hash, opts) == -1)
+			return 1;
+		if (spool->range_start == 0 && opts->snapshot_parts > 1) {
+			/* a spool of parts has holes, it can not be resumed */
+			if (unlinkat(opts->primary_dir,
+			    SNAPSHOT_META_FILENAME, 0) == -1 &&
+			    errno != ENOENT)
+				log_warn("%s - unlink %s", __func__,
+				    SNAPSHOT_META_FILENAME);
+			if (fetch_snapshot_parts(uri, opts,
+			    spool->spool_fd) == 0)
+				goto parse;
+			if (ftruncate(spool->spool_fd, 0) == -1) {
+				log_warn("%s - truncate %s", __func__,
+				    SNAPSHOT_SPOOL_FILENAME);
+				goto done;
+			}
+		}
+		if (start_snapshot_spool(spool, hash) == -1)
+			goto done;
+	}
+
+	status = fetch_xml_wait(spool);
+	if (status != 200 && status != 206 && status != 416) {
+		/* keep what we have for the next run */
+		write_snapshot_meta(opts, uri, hash, spool->validator);
+		close(spool->spool_fd);
+		if (spool != &local)
+			free(spool);
+		return 1;
+	}
+
+parse:
+	/* the hash covers the whole document, check it while parsing */
+	if (lseek(spool->spool_fd, 0, SEEK_SET) == -1) {
+		log_warn("%s - lseek", __func__);
+		goto done;
+	}
 	setup_xml_data(&xml_data, &snapshot_xml, uri, hash, opts, nxml);
-	if (fetch_xml_uri(&xml_data) != 200)
-		ret = 1;
+	if (parse_xml_file(&xml_data, spool->spool_fd) == 0)
+		ret = 0;
 	free_snapshot_xml_data(&xml_data);
+done:
+	close(spool->spool_fd);
+	if (spool != &local)
+		free(spool);
+	remove_snapshot_spool(opts);
 	return ret;
 }
-
@@ -20,10 +20,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
-#include <err.h>
 #include <errno.h>
 #include <ctype.h>
-#include <resolv.h>
 
 #include <unistd.h>
 #include <sys/stat.h>
@@ -42,24 +40,149 @@ xstrdup(const char *s)
 	return r;
 }
 
-int b64_decode(char *src, unsigned char **b64)
+/*
+ * Incremental base64 decoding of publish content as it comes from the
+ * parser. Whitespace is skipped anywhere, padding and trailing bits are
+ * checked as strictly as b64_pton(3) does.
+ */
+void
+b64_decode_init(struct b64_state *st)
 {
-	size_t sz;
-	int b64sz;
+	memset(st, 0, sizeof(*st));
+}
 
-	if (!src || !b64)
-		return -1;
+#define XX	0xff	/* not base64 */
+#define WS	0xfe	/* whitespace */
+#define PD	0xfd	/* padding */
+
+static const unsigned char b64_table[256] = {
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, WS, WS, WS, WS, WS, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	WS, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, 62, XX, XX, XX, 63,
+	52, 53, 54, 55, 56, 57, 58, 59, 60, 61, XX, XX, XX, PD, XX, XX,
+	XX,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+	15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, XX, XX, XX, XX, XX,
+	XX, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+	41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+};
 
-	sz = ((strlen(src) + 3) / 4) * 3 + 1;
-	if ((*b64 = malloc(sz)) == NULL)
-		fatal("%s - malloc", __func__);
-	if ((b64sz = b64_pton(src, *b64, sz)) < 0) {
-		free(*b64);
-		*b64 = NULL;
-		log_warnx("failed to b64 decode: %s", src);
-		return -1;
+/*
+ * Decode len characters from src into dst, which must have room for
+ * len / 4 * 3 + 3 bytes. Returns the number of bytes or -1 on bad input.
+ */
+static int
+b64_decode_update(struct b64_state *st, const char *src, size_t len,
+    unsigned char *dst)
+{
+	const unsigned char *in = (const unsigned char *)src;
+	unsigned char *out = dst;
+	unsigned int v;
+
+	while (len > 0) {
+		/*
+		 * Between quantums take all that follow without whitespace
+		 * or padding in one go, the table marks everything else
+		 * with the high bit.
+		 */
+		if (st->count == 0 && st->pad == B64_PAD_NONE) {
+			while (len >= 4) {
+				v = b64_table[in[0]] | b64_table[in[1]] |
+				    b64_table[in[2]] | b64_table[in[3]];
+				if (v & 0x80)
+					break;
+				v = b64_table[in[0]] << 18 |
+				    b64_table[in[1]] << 12 |
+				    b64_table[in[2]] << 6 | b64_table[in[3]];
+				*out++ = v >> 16;
+				*out++ = v >> 8;
+				*out++ = v;
+				in += 4;
+				len -= 4;
+			}
+			if (len == 0)
+				break;
+		}
+		v = b64_table[*in++];
+		len--;
+		if (v == WS)
+			continue;
+		if (st->pad == B64_PAD_DONE)
+			return -1;
+		if (st->pad == B64_PAD_ONE_MORE) {
+			if (v != PD)
+				return -1;
+			st->pad = B64_PAD_DONE;
+			continue;
+		}
+		if (v == PD) {
+			/* the bits not making up a whole byte must be 0 */
+			if (st->count == 2 && (st->bits & 0xf) == 0) {
+				*out++ = st->bits >> 4;
+				st->pad = B64_PAD_ONE_MORE;
+			} else if (st->count == 3 && (st->bits & 0x3) == 0) {
+				*out++ = st->bits >> 10;
+				*out++ = st->bits >> 2;
+				st->pad = B64_PAD_DONE;
+			} else
+				return -1;
+			continue;
+		}
+		if (v == XX)
+			return -1;
+		st->bits = st->bits << 6 | v;
+		if (++st->count == 4) {
+			*out++ = st->bits >> 16;
+			*out++ = st->bits >> 8;
+			*out++ = st->bits;
+			st->bits = 0;
+			st->count = 0;
+		}
 	}
-	return b64sz;
+	return out - dst;
+}
+
+/*
+ * Decode len characters from src and write the result to f. Returns -1
+ * if the input is not valid base64 or the write failed.
+ */
+int
+b64_decode_write(struct b64_state *st, const char *src, size_t len, FILE *f)
+{
+	unsigned char buf[B64_CHUNK / 4 * 3 + 3];
+	size_t n;
+	int sz;
+
+	while (len > 0) {
+		n = len < B64_CHUNK ? len : B64_CHUNK;
+		if ((sz = b64_decode_update(st, src, n, buf)) == -1)
+			return -1;
+		if (fwrite(buf, 1, sz, f) != (size_t)sz)
+			return -1;
+		src += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Check that the input ended on a complete quantum.
+ */
+int
+b64_decode_final(struct b64_state *st)
+{
+	if (st->pad == B64_PAD_ONE_MORE)
+		return -1;
+	if (st->pad == B64_PAD_NONE && st->count != 0)
+		return -1;
+	return 0;
 }
 
 /* TODO stolen from rpki atm */
@@ -181,13 +304,17 @@ fetch_filename_from_uri(const char *uri, const char *proto)
 	const char *module;
 	size_t modulesz;
 
-	if (!uri)
-		err(1, "tried to write to defunct publish uri");
+	if (!uri) {
+		log_warnx("tried to write to defunct publish uri");
+		return NULL;
+	}
 	if (rsync_uri_parse(NULL, NULL,
 			    &module, &modulesz,
 			    NULL, NULL,
-			    NULL, uri, proto) == 0)
-		err(1, "parse uri elem fail");
+			    NULL, uri, proto) == 0) {
+		log_warnx("parse uri elem fail: %s", uri);
+		return NULL;
+	}
 
 	return module;
 }
@@ -202,7 +329,8 @@ open_uri(char *uri, char *dir_name, int dir, int write)
 	char * open_flags = "r";
 	FILE *f;
 
-	filename = fetch_filename_from_uri(uri, NULL);
+	if ((filename = fetch_filename_from_uri(uri, NULL)) == NULL)
+		return NULL;
 	if (write) {
 		if ((path_delim = strrchr(filename, '/'))) {
 			/* XXX NF better way to do this directory sep? */
@@ -249,19 +377,29 @@ void
 free_workdir(struct opts *opts)
 {
 	free(opts->basedir_working);
-	close(opts->working_dir);
+	if (opts->working_dir != -1)
+		close(opts->working_dir);
 }
-void
+int
 make_workdir(const char *basedir, struct opts *opts)
 {
 	char *tmpl;
 
 	if (asprintf(&tmpl, "%s.XXXXXXXX", basedir) == -1)
-		err(1, "asprintf");
-	if (mkdtemp(tmpl) == NULL)
-		err(1, "mkdtemp");
+		fatal("%s - asprintf", __func__);
+	if (mkdtemp(tmpl) == NULL) {
+		log_warn("%s: mkdtemp", tmpl);
+		free(tmpl);
+		return -1;
+	}
 	opts->basedir_working = tmpl;
 	opts->working_dir = open(opts->basedir_working, O_RDONLY|O_DIRECTORY);
-	if (opts->working_dir < 0)
-		err(1, "open");
+	if (opts->working_dir < 0) {
+		log_warn("%s: open", opts->basedir_working);
+		rmdir(opts->basedir_working);
+		free(opts->basedir_working);
+		opts->basedir_working = NULL;
+		return -1;
+	}
+	return 0;
 }
@@ -0,0 +1,751 @@
+/*
+ * Copyright (c) 2020 Nils Fisher <nils_fisher@hotmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <expat.h>
+
+#include "log.h"
+#include "rrdp.h"
+
+/*
+ * Snapshots and deltas only use a small part of XML: two levels of
+ * elements with a few attributes and base64 text. The tokenizer here
+ * handles just that and calls the same element and character data
+ * handlers expat would. Text is found with memchr() and handed over
+ * where it is, names and attribute values are terminated in place in
+ * the receive buffer. Line ends in text are passed on as they are, the
+ * base64 decoder skips them anyway.
+ *
+ * A document that needs more of XML (a DOCTYPE, another encoding) is
+ * handed over to expat as long as no element has been seen, after that
+ * anything unknown is a parse error.
+ */
+
+/* longest markup or reference carried over to the next buffer */
+#define XML_TOK_MAX	(64 * 1024)
+#define XML_TOK_DEPTH	8
+#define XML_TOK_NAME	64
+#define XML_TOK_ATTRS	16
+
+/* returned while in the prolog if expat has to take over */
+#define XML_TOK_FALLBACK	-2
+
+#define XML_IS_SPACE(c)	\
+	((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == '\n')
+
+enum xml_tok_state {
+	XML_TOK_PROLOG,
+	XML_TOK_CONTENT,
+	XML_TOK_EPILOG,
+	XML_TOK_EXPAT,
+	XML_TOK_FAILED
+};
+
+struct xml_tok {
+	enum xml_tok_state	state;
+	XML_StartElementHandler	start;
+	XML_EndElementHandler	end;
+	XML_CharacterDataHandler text;
+	void			*data;
+	/* the whole prolog, later markup cut off at the end of a buffer */
+	char			*buf;
+	size_t			len;
+	size_t			size;
+	size_t			off;
+	char			names[XML_TOK_DEPTH][XML_TOK_NAME];
+	int			depth;
+	/* bytes of the document consumed, for error messages */
+	long long		pos;
+	const char		*error;
+};
+
+static ssize_t	xml_markup(struct xml_tok *, char *, size_t);
+
+static int
+xml_fail(struct xml_tok *t, const char *error)
+{
+	t->state = XML_TOK_FAILED;
+	t->error = error;
+	return -1;
+}
+
+static size_t
+xml_name_len(const char *s, const char *e)
+{
+	const char *p;
+	unsigned char c;
+
+	for (p = s; p < e; p++) {
+		c = *p;
+		if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+		    c == '_' || c == ':')
+			continue;
+		if (p > s && ((c >= '0' && c <= '9') || c == '-' || c == '.'))
+			continue;
+		break;
+	}
+	return p - s;
+}
+
+/*
+ * Compare the start of s to str. Returns -1 if s is too short to tell.
+ */
+static int
+xml_prefix(const char *s, size_t n, const char *str)
+{
+	size_t len = strlen(str);
+
+	if (n < len)
+		return memcmp(s, str, n) == 0 ? -1 : 0;
+	return memcmp(s, str, len) == 0;
+}
+
+static int
+xml_utf8(const unsigned char *s, const unsigned char *e)
+{
+	int n;
+
+	while (s < e) {
+		if (*s < 0x80) {
+			s++;
+			continue;
+		}
+		if (*s >= 0xc2 && *s <= 0xdf)
+			n = 1;
+		else if (*s >= 0xe0 && *s <= 0xef)
+			n = 2;
+		else if (*s >= 0xf0 && *s <= 0xf4)
+			n = 3;
+		else
+			return 0;
+		if (e - s <= n)
+			return 0;
+		for (s++; n > 0; n--, s++)
+			if ((*s & 0xc0) != 0x80)
+				return 0;
+	}
+	return 1;
+}
+
+/*
+ * Decode the reference between '&' and ';' in s into out as UTF-8.
+ * Returns the length written or -1.
+ */
+static int
+xml_ref(const char *s, size_t n, char *out)
+{
+	unsigned long c = 0;
+	size_t i;
+	int base = 10, d;
+
+	if (n == 2 && memcmp(s, "lt", 2) == 0)
+		c = '<';
+	else if (n == 2 && memcmp(s, "gt", 2) == 0)
+		c = '>';
+	else if (n == 3 && memcmp(s, "amp", 3) == 0)
+		c = '&';
+	else if (n == 4 && memcmp(s, "quot", 4) == 0)
+		c = '"';
+	else if (n == 4 && memcmp(s, "apos", 4) == 0)
+		c = '\'';
+	else if (n >= 2 && s[0] == '#') {
+		i = 1;
+		if (s[1] == 'x') {
+			base = 16;
+			i++;
+		}
+		if (i == n || n - i > 8)
+			return -1;
+		for (; i < n; i++) {
+			if (s[i] >= '0' && s[i] <= '9')
+				d = s[i] - '0';
+			else if (base == 16 && s[i] >= 'a' && s[i] <= 'f')
+				d = s[i] - 'a' + 10;
+			else if (base == 16 && s[i] >= 'A' && s[i] <= 'F')
+				d = s[i] - 'A' + 10;
+			else
+				return -1;
+			c = c * base + d;
+		}
+		if ((c < 0x20 && c != '\t' && c != '\n' && c != '\r') ||
+		    (c >= 0xd800 && c <= 0xdfff) || c == 0xfffe ||
+		    c == 0xffff || c > 0x10ffff)
+			return -1;
+	} else
+		return -1;
+
+	if (c < 0x80) {
+		out[0] = c;
+		return 1;
+	} else if (c < 0x800) {
+		out[0] = 0xc0 | c >> 6;
+		out[1] = 0x80 | (c & 0x3f);
+		return 2;
+	} else if (c < 0x10000) {
+		out[0] = 0xe0 | c >> 12;
+		out[1] = 0x80 | (c >> 6 & 0x3f);
+		out[2] = 0x80 | (c & 0x3f);
+		return 3;
+	}
+	out[0] = 0xf0 | c >> 18;
+	out[1] = 0x80 | (c >> 12 & 0x3f);
+	out[2] = 0x80 | (c >> 6 & 0x3f);
+	out[3] = 0x80 | (c & 0x3f);
+	return 4;
+}
+
+/*
+ * Normalize the attribute value between s and e in place and terminate
+ * it. References shrink, so the value never grows.
+ */
+static int
+xml_attr_value(char *s, char *e)
+{
+	char *r, *w, *q, u[4];
+	int l;
+
+	for (r = w = s; r < e; r++) {
+		if (*r == '&') {
+			if ((q = memchr(r, ';', e - r)) == NULL ||
+			    (l = xml_ref(r + 1, q - r - 1, u)) == -1)
+				return -1;
+			memcpy(w, u, l);
+			w += l;
+			r = q;
+			continue;
+		}
+		if (*r == '<' || ((unsigned char)*r < 0x20 &&
+		    !XML_IS_SPACE(*r)))
+			return -1;
+		if (*r == '\r' && r + 1 < e && r[1] == '\n')
+			r++;
+		*w++ = XML_IS_SPACE(*r) ? ' ' : *r;
+	}
+	if (!xml_utf8((unsigned char *)s, (unsigned char *)w))
+		return -1;
+	*w = '\0';
+	return 0;
+}
+
+static int
+xml_end_elem(struct xml_tok *t)
+{
+	t->end(t->data, t->names[t->depth - 1]);
+	if (t->state == XML_TOK_FAILED)
+		return -1;
+	if (--t->depth == 0)
+		t->state = XML_TOK_EPILOG;
+	return 0;
+}
+
+/*
+ * Start tag or empty element tag in s. Returns the bytes used, 0 if
+ * the tag is not complete yet or -1.
+ */
+static ssize_t
+xml_start_tag(struct xml_tok *t, char *s, size_t n)
+{
+	const char *attr[2 * XML_TOK_ATTRS + 1];
+	char *name[XML_TOK_ATTRS], *val[XML_TOK_ATTRS], *vend[XML_TOK_ATTRS];
+	size_t namelen[XML_TOK_ATTRS];
+	char *p, *q, *e = s + n, *space;
+	size_t len;
+	int i, j, nattr = 0, empty = 0;
+
+	/* find the end first, attribute values may hold a '>' */
+	for (q = s + 1; q < e && *q != '>'; q++) {
+		if ((*q == '"' || *q == '\'') &&
+		    (q = memchr(q + 1, *q, e - q - 1)) == NULL)
+			return 0;
+	}
+	if (q == e)
+		return 0;
+	e = q;
+
+	p = s + 1;
+	len = xml_name_len(p, e);
+	if (len == 0 || len >= XML_TOK_NAME)
+		return xml_fail(t, "invalid element name");
+	p += len;
+	for (;;) {
+		space = p;
+		while (p < e && XML_IS_SPACE(*p))
+			p++;
+		if (p == e)
+			break;
+		if (*p == '/' && p + 1 == e) {
+			empty = 1;
+			break;
+		}
+		if (p == space)
+			return xml_fail(t, "malformed start tag");
+		if (nattr == XML_TOK_ATTRS)
+			return xml_fail(t, "too many attributes");
+		name[nattr] = p;
+		if ((namelen[nattr] = xml_name_len(p, e)) == 0)
+			return xml_fail(t, "invalid attribute name");
+		p += namelen[nattr];
+		while (p < e && XML_IS_SPACE(*p))
+			p++;
+		if (p == e || *p++ != '=')
+			return xml_fail(t, "malformed attribute");
+		while (p < e && XML_IS_SPACE(*p))
+			p++;
+		if (p == e || (*p != '"' && *p != '\''))
+			return xml_fail(t, "malformed attribute");
+		val[nattr] = p + 1;
+		if ((vend[nattr] = memchr(p + 1, *p, e - p - 1)) == NULL)
+			return xml_fail(t, "malformed attribute");
+		p = vend[nattr++] + 1;
+	}
+	for (i = 0; i < nattr; i++)
+		for (j = 0; j < i; j++)
+			if (namelen[i] == namelen[j] &&
+			    memcmp(name[i], name[j], namelen[i]) == 0)
+				return xml_fail(t, "duplicate attribute");
+	if (t->depth == XML_TOK_DEPTH)
+		return xml_fail(t, "elements nested too deep");
+
+	/* everything checked, terminate names and values in place */
+	s[1 + len] = '\0';
+	for (i = 0; i < nattr; i++) {
+		name[i][namelen[i]] = '\0';
+		if (xml_attr_value(val[i], vend[i]) == -1)
+			return xml_fail(t, "invalid attribute value");
+		attr[2 * i] = name[i];
+		attr[2 * i + 1] = val[i];
+	}
+	attr[2 * nattr] = NULL;
+
+	memcpy(t->names[t->depth++], s + 1, len + 1);
+	t->state = XML_TOK_CONTENT;
+	t->start(t->data, s + 1, attr);
+	if (t->state == XML_TOK_FAILED)
+		return -1;
+	if (empty && xml_end_elem(t) == -1)
+		return -1;
+	t->pos += e + 1 - s;
+	return e + 1 - s;
+}
+
+static ssize_t
+xml_end_tag(struct xml_tok *t, char *s, size_t n)
+{
+	char *p, *q;
+	size_t len;
+
+	if ((q = memchr(s, '>', n)) == NULL)
+		return 0;
+	len = xml_name_len(s + 2, q);
+	for (p = s + 2 + len; p < q && XML_IS_SPACE(*p); p++)
+		;
+	if (len == 0 || p != q)
+		return xml_fail(t, "malformed end tag");
+	if (t->depth == 0 || len != strlen(t->names[t->depth - 1]) ||
+	    memcmp(s + 2, t->names[t->depth - 1], len) != 0)
+		return xml_fail(t, "mismatched tag");
+	if (xml_end_elem(t) == -1)
+		return -1;
+	t->pos += q + 1 - s;
+	return q + 1 - s;
+}
+
+/*
+ * Processing instructions are skipped, the XML declaration is only
+ * checked for an encoding other than UTF-8.
+ */
+static ssize_t
+xml_pi(struct xml_tok *t, char *s, size_t n)
+{
+	char *q, *p, *v;
+	size_t len;
+	int bom;
+
+	if (n < 4 || (q = memmem(s + 2, n - 2, "?>", 2)) == NULL)
+		return 0;
+	len = xml_name_len(s + 2, q);
+	if (len == 3 && strncasecmp(s + 2, "xml", 3) == 0) {
+		bom = t->len >= 3 && memcmp(t->buf, "\xef\xbb\xbf", 3) == 0;
+		if (t->state != XML_TOK_PROLOG || s != t->buf + (bom ? 3 : 0))
+			return xml_fail(t, "misplaced XML declaration");
+		if ((p = memmem(s, q - s, "encoding", 8)) != NULL) {
+			for (p += 8; p < q && (XML_IS_SPACE(*p) ||
+			    *p == '=' || *p == '"' || *p == '\''); p++)
+				;
+			for (v = p; p < q && *p != '"' && *p != '\''; p++)
+				;
+			if (!((p - v == 5 && strncasecmp(v, "UTF-8", 5) == 0) ||
+			    (p - v == 8 && strncasecmp(v, "US-ASCII", 8) == 0)))
+				return XML_TOK_FALLBACK;
+		}
+	}
+	t->pos += q + 2 - s;
+	return q + 2 - s;
+}
+
+/*
+ * Comments, CDATA sections and declarations.
+ */
+static ssize_t
+xml_decl(struct xml_tok *t, char *s, size_t n)
+{
+	char *q;
+	int r;
+
+	if ((r = xml_prefix(s, n, "<!--")) == 1) {
+		if ((q = memmem(s + 4, n - 4, "--", 2)) == NULL ||
+		    q + 2 == s + n)
+			return 0;
+		if (q[2] != '>')
+			return xml_fail(t, "'--' in comment");
+		t->pos += q + 3 - s;
+		return q + 3 - s;
+	} else if (r == -1)
+		return 0;
+	if (t->state == XML_TOK_PROLOG)
+		return XML_TOK_FALLBACK;
+	if ((r = xml_prefix(s, n, "<![CDATA[")) == 1 &&
+	    t->state == XML_TOK_CONTENT) {
+		if ((q = memmem(s + 9, n - 9, "]]>", 3)) == NULL)
+			return 0;
+		if (q > s + 9) {
+			t->text(t->data, s + 9, q - s - 9);
+			if (t->state == XML_TOK_FAILED)
+				return -1;
+		}
+		t->pos += q + 3 - s;
+		return q + 3 - s;
+	} else if (r == -1)
+		return 0;
+	return xml_fail(t, "unsupported markup");
+}
+
+/*
+ * Markup starting at s. Returns the bytes used, 0 if more are needed,
+ * -1 on error or XML_TOK_FALLBACK.
+ */
+static ssize_t
+xml_markup(struct xml_tok *t, char *s, size_t n)
+{
+	if (n < 2)
+		return 0;
+	switch (s[1]) {
+	case '/':
+		if (t->state == XML_TOK_PROLOG)
+			return XML_TOK_FALLBACK;
+		return xml_end_tag(t, s, n);
+	case '?':
+		return xml_pi(t, s, n);
+	case '!':
+		return xml_decl(t, s, n);
+	default:
+		if (t->state == XML_TOK_EPILOG)
+			return xml_fail(t, "junk after document element");
+		return xml_start_tag(t, s, n);
+	}
+}
+
+/*
+ * Hand the character data in s to the text handler, decoding references
+ * on the way. A reference cut off at the end is left over unless the
+ * text is known to be complete. Returns the bytes used or -1.
+ */
+static ssize_t
+xml_text(struct xml_tok *t, char *s, size_t n, int complete)
+{
+	char *p = s, *e = s + n, *a, *q, u[4];
+	int l;
+
+	while (p < e) {
+		if ((a = memchr(p, '&', e - p)) == NULL)
+			a = e;
+		if (a > p) {
+			t->text(t->data, p, a - p);
+			if (t->state == XML_TOK_FAILED)
+				return -1;
+			t->pos += a - p;
+			p = a;
+		}
+		if (a == e)
+			break;
+		if ((q = memchr(a, ';', e - a)) == NULL) {
+			if (complete)
+				return xml_fail(t, "unterminated reference");
+			break;
+		}
+		if ((l = xml_ref(a + 1, q - a - 1, u)) == -1)
+			return xml_fail(t, "invalid reference");
+		t->text(t->data, u, l);
+		if (t->state == XML_TOK_FAILED)
+			return -1;
+		t->pos += q + 1 - a;
+		p = q + 1;
+	}
+	return p - s;
+}
+
+static int
+xml_tok_append(struct xml_tok *t, const char *s, size_t n)
+{
+	char *buf;
+	size_t size;
+
+	if (t->len + n > XML_TOK_MAX)
+		return xml_fail(t, "markup too long");
+	if (t->len + n > t->size) {
+		size = t->size == 0 ? 1024 : t->size;
+		while (size < t->len + n)
+			size *= 2;
+		if ((buf = realloc(t->buf, size)) == NULL)
+			fatal("%s - realloc", __func__);
+		t->buf = buf;
+		t->size = size;
+	}
+	memcpy(t->buf + t->len, s, n);
+	t->len += n;
+	return 0;
+}
+
+/*
+ * Work through the prolog collected in t->buf up to the root element.
+ * Returns 0 if more is needed, 1 once the root element started, -1 or
+ * XML_TOK_FALLBACK.
+ */
+static int
+xml_prolog(struct xml_tok *t)
+{
+	char *s, *e;
+	ssize_t r;
+
+	if (t->off == 0 && xml_prefix(t->buf, t->len, "\xef\xbb\xbf") != 0) {
+		if (t->len < 3)
+			return 0;
+		t->off = 3;
+		t->pos = 3;
+	}
+	for (;;) {
+		s = t->buf + t->off;
+		e = t->buf + t->len;
+		while (s < e && XML_IS_SPACE(*s))
+			s++;
+		t->pos += s - (t->buf + t->off);
+		t->off = s - t->buf;
+		if (s == e)
+			return 0;
+		if (*s != '<')
+			return XML_TOK_FALLBACK;
+		if ((r = xml_markup(t, s, e - s)) <= 0)
+			return r;
+		t->off += r;
+		if (t->state != XML_TOK_PROLOG) {
+			t->len = t->off = 0;
+			return 1;
+		}
+	}
+}
+
+/*
+ * Give up on the tokenizer and pass everything seen so far to expat.
+ */
+static int
+xml_tok_expat(struct xml_tok *t, XML_Parser p, char *s, size_t n, int final)
+{
+	t->state = XML_TOK_EXPAT;
+	if (XML_Parse(p, t->buf, t->len, final && n == 0) != XML_STATUS_OK)
+		return -1;
+	if (n > 0 && XML_Parse(p, s, n, final) != XML_STATUS_OK)
+		return -1;
+	return 0;
+}
+
+static int
+xml_tok_feed(struct xml_tok *t, XML_Parser p, char *s, size_t n, int final)
+{
+	char *e = s + n, *q;
+	ssize_t r;
+	size_t l;
+
+	while (t->state == XML_TOK_PROLOG && n > 0 && s < e) {
+		q = memchr(s, '>', e - s);
+		l = q != NULL ? (size_t)(q - s + 1) : (size_t)(e - s);
+		if (xml_tok_append(t, s, l) == -1)
+			return -1;
+		s += l;
+		if ((r = xml_prolog(t)) == XML_TOK_FALLBACK)
+			return xml_tok_expat(t, p, s, e - s, final);
+		if (r == -1)
+			return -1;
+	}
+	if (t->state == XML_TOK_PROLOG)
+		return final ? xml_tok_expat(t, p, s, 0, final) : 0;
+
+	/* finish what was cut off at the end of the last buffer */
+	while (t->len > 0 && n > 0 && s < e) {
+		q = memchr(s, t->buf[0] == '&' ? ';' : '>', e - s);
+		l = q != NULL ? (size_t)(q - s + 1) : (size_t)(e - s);
+		if (xml_tok_append(t, s, l) == -1)
+			return -1;
+		s += l;
+		if (t->buf[0] == '&')
+			r = xml_text(t, t->buf, t->len, 0);
+		else
+			r = xml_markup(t, t->buf, t->len);
+		if (r == -1)
+			return -1;
+		if (r > 0)
+			t->len = 0;
+	}
+
+	while (n > 0 && s < e) {
+		if (t->state == XML_TOK_EPILOG) {
+			for (q = s; q < e && XML_IS_SPACE(*q); q++)
+				;
+			t->pos += q - s;
+			if ((s = q) == e)
+				break;
+			if (*s != '<')
+				return xml_fail(t,
+				    "junk after document element");
+		} else if (t->state == XML_TOK_CONTENT) {
+			q = memchr(s, '<', e - s);
+			l = (q != NULL ? q : e) - s;
+			if ((r = xml_text(t, s, l, q != NULL)) == -1)
+				return -1;
+			if (q == NULL) {
+				if (xml_tok_append(t, s + r, l - r) == -1)
+					return -1;
+				break;
+			}
+			s = q;
+		} else
+			return -1;
+		if ((r = xml_markup(t, s, e - s)) == -1)
+			return -1;
+		if (r == 0) {
+			if (xml_tok_append(t, s, e - s) == -1)
+				return -1;
+			break;
+		}
+		s += r;
+	}
+
+	if (final && t->state == XML_TOK_CONTENT)
+		return xml_fail(t, "unclosed element");
+	if (final && t->len > 0)
+		return xml_fail(t, "unclosed token");
+	return t->state == XML_TOK_FAILED ? -1 : 0;
+}
+
+/*
+ * Use the tokenizer with these handlers for data instead of expat. The
+ * expat parser stays around in case the document needs it. A tokenizer
+ * data already has starts over and keeps its buffer.
+ */
+void
+xml_tok_init(struct xmldata *data, XML_StartElementHandler start,
+    XML_EndElementHandler end, XML_CharacterDataHandler text)
+{
+	struct xml_tok *t = data->tok;
+
+	if (t == NULL && (t = calloc(1, sizeof(*t))) == NULL)
+		fatal("%s - calloc", __func__);
+	t->state = XML_TOK_PROLOG;
+	t->len = t->off = 0;
+	t->depth = 0;
+	t->pos = 0;
+	t->error = NULL;
+	t->start = start;
+	t->end = end;
+	t->text = text;
+	t->data = data;
+	data->tok = t;
+}
+
+void
+xml_tok_free(struct xmldata *data)
+{
+	if (data->tok == NULL)
+		return;
+	free(data->tok->buf);
+	free(data->tok);
+	data->tok = NULL;
+}
+
+/*
+ * Memory to put the next len bytes of the document in, so that expat can
+ * parse them where they are. Returns NULL if the document does not go to
+ * expat, the caller then uses a buffer of its own.
+ */
+char *
+xml_buffer(struct xmldata *data, size_t len)
+{
+	if (data->parser == NULL || data->stop ||
+	    (data->tok != NULL && data->tok->state != XML_TOK_EXPAT))
+		return NULL;
+	data->buffer = XML_GetBuffer(data->parser, len);
+	return data->buffer;
+}
+
+/*
+ * Feed the next len bytes of the document to the tokenizer or expat,
+ * final marks the end of it. buf may be modified, if it came from
+ * xml_buffer() it is not copied. Returns -1 on a parse error or if a
+ * handler stopped the parse.
+ */
+int
+xml_parse(struct xmldata *data, char *buf, size_t len, int final)
+{
+	struct xml_tok *t = data->tok;
+	char *buffer = data->buffer;
+
+	data->buffer = NULL;
+	if (buf != NULL && buf == buffer) {
+		if (XML_ParseBuffer(data->parser, len, final) == XML_STATUS_OK)
+			return 0;
+	} else if (t != NULL && t->state != XML_TOK_EXPAT) {
+		if (xml_tok_feed(t, data->parser, buf, len, final) == 0)
+			return 0;
+		if (t->state != XML_TOK_EXPAT) {
+			if (!data->stop)
+				fprintf(stderr, "Parse error at byte %lld:\n"
+				    "%s\n", t->pos, t->error != NULL ?
+				    t->error : "parsing aborted");
+			return -1;
+		}
+	} else if (XML_Parse(data->parser, buf, len, final) == XML_STATUS_OK)
+		return 0;
+	if (!data->stop)
+		fprintf(stderr, "Parse error at line %lu:\n%s\n",
+		    XML_GetCurrentLineNumber(data->parser),
+		    XML_ErrorString(XML_GetErrorCode(data->parser)));
+	return -1;
+}
+
+/*
+ * Stop the parse from within a handler.
+ */
+void
+xml_stop(struct xmldata *data)
+{
+	if (data->tok != NULL && data->tok->state != XML_TOK_EXPAT)
+		data->tok->state = XML_TOK_FAILED;
+	else
+		XML_StopParser(data->parser, XML_FALSE);
+}